@@ -12,6 +12,18 @@
 #include <linux/wait.h>
 #include <linux/blkdev.h>
 #include <linux/blkpg.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/moduleparam.h>
+#include <linux/proc_fs.h>
+#include <linux/crypto.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/device.h>
 #include <linux/delay.h>
 #include <linux/io.h>
 
@@ -24,10 +36,108 @@ static struct request_queue *ramblock_queue;
 
 static int major;
 
-static DEFINE_SPINLOCK(ramblock_lock);
+#define PAGE_SECTORS_SHIFT	(PAGE_SHIFT - 9)
+#define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
+#define FREE_BATCH		16
 
-#define RAMBLOCK_SIZE   (1024*1024)
-static unsigned char *ramblock_buf;
+#ifdef CONFIG_EXT2_FS_XIP
+/* XIPҪpage_address()ֱӷҳ, Բø߶ڴ */
+#define RAMBLOCK_GFP	(GFP_NOIO | __GFP_ZERO)
+#else
+#define RAMBLOCK_GFP	(GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO)
+#endif
+
+/* , λMB. ֻǶƵĴС, ҳڵһдʱŷ */
+static unsigned long ramblock_mb = 1;
+module_param(ramblock_mb, ulong, 0444);
+MODULE_PARM_DESC(ramblock_mb, "ramblock capacity in MiB (default 1)");
+
+/* ҳΪĻ, ֻдҳ; 鲻ľǿն, ȫ0 */
+static RADIX_TREE(ramblock_pages, GFP_ATOMIC);
+static DEFINE_SPINLOCK(ramblock_pages_lock);
+static unsigned long ramblock_nr_pages;		/* ǰռõҳ */
+static unsigned long ramblock_pages_freed;	/* discard/д0 ͷŵҳ */
+
+/* ѹģʽ : ÿҳѹkmalloc, ʱŵstruct ramblock_zpage */
+static int ramblock_compress;
+module_param(ramblock_compress, int, 0444);
+MODULE_PARM_DESC(ramblock_compress, "store pages deflate-compressed (default 0)");
+
+#define RAMBLOCK_MAX_ZSIZE	(PAGE_SIZE / 4 * 3)	/* ѹԭ */
+
+struct ramblock_zpage {
+	pgoff_t index;
+	unsigned int len;	/* 0 : ҳfillֵ; PAGE_SIZE : ûѹ */
+	unsigned long fill;
+	unsigned char data[0];
+};
+
+/* ѹʱֻһ, ѹģʽµĶдramblock_zmutex½ */
+static DEFINE_MUTEX(ramblock_zmutex);
+static struct crypto_comp *ramblock_tfm;
+static unsigned char *ramblock_zbuf;	/* ѹҳ */
+static unsigned char *ramblock_cbuf;	/* ѹ */
+
+static unsigned long ramblock_compr_size;	/* ѹ */
+static unsigned long ramblock_mem_used;		/* ͬzpageͷһʵռõڴ */
+static unsigned long ramblock_same_pages;	/* ֻfillֵҳ */
+
+/* ÿCPUһݶдͳ, ͨ·ֻۼԼCPUļ, ӡҲ */
+#define RAMBLOCK_LAT_BUCKETS	16	/* n : ʱ < 2^n us, һ񲻷ⶥ */
+
+struct ramblock_stats {
+	unsigned long rd_ops;
+	unsigned long wr_ops;
+	unsigned long long rd_bytes;
+	unsigned long long wr_bytes;
+	unsigned long lat_hist[RAMBLOCK_LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct ramblock_stats, ramblock_stats);
+
+/* һͨdirect_accessҳ潻ȥ(ܱӳ䵽ûռ), Ͳͷ */
+static int ramblock_xip_used;
+
+static struct proc_dir_entry *ramblock_proc;
+
+/*
+ *  : /dev/ramblock_snap
+ *   cat /dev/ramblock_snap > img		, ֻڵҳ
+ *   cat img > /dev/ramblock_snap		ָ, ָֻܻ(insmod)
+ * ʽ(ֽu32) :
+ *   ͷ     magic, version, page_size, (ҳ)
+ *   extent ʼҳ, ҳ,  ҳ*page_size ֽ
+ *      ҳΪ0extent
+ * /ָڼ䲻Ҫҽʹ
+ */
+#define RAMBLOCK_SNAP_MAGIC	0x4E534252	/* "RBSN" */
+#define RAMBLOCK_SNAP_VERSION	1
+#define RAMBLOCK_SNAP_MAX_EXTENT	1024
+
+enum {
+	SNAP_HEADER,
+	SNAP_EXTENT,
+	SNAP_DATA,
+	SNAP_END,
+};
+
+struct ramblock_snap {
+	int state;
+	pgoff_t next;		/* һҪ/дҳ */
+	unsigned int left;	/* ǰextentʣҳ */
+	unsigned int len;	/* bufһԪĳ */
+	unsigned int pos;	/* һԪѾ/յֽ */
+	unsigned char *buf;
+};
+
+static int snap_major;
+static struct class *snap_cls;
+static unsigned long ramblock_snap_busy;
+
+/* ںûBLKDISCARD, ں˵ı :  u64[2] = {ʼֽ, } */
+#ifndef BLKDISCARD
+#define BLKDISCARD	_IO(0x12,119)
+#endif
 
 static int ramblock_getgeo(struct block_device *bdev, struct hd_geometry *geo)
 {
@@ -35,57 +145,898 @@ static int ramblock_getgeo(struct block_device *bdev, struct hd_geometry *geo)
 	/* = heads * sectors * cylinders *512*/
 	geo->heads 	= 2;
 	geo->sectors 	= 32;
-	geo->cylinders = RAMBLOCK_SIZE/2/32/512;
+	/* cylindersֻ16λ, 2048MBϵ̾ͷⶥ */
+	geo->cylinders = min_t(unsigned long, ramblock_mb*(1024*1024/2/32/512), 0xffff);
+	return 0;
+}
+
+/*
+ * ҵsectorڵҳ沢һ, Ժput_page.
+ * Լһ, ҳɾͬʱ˿ܻڿ,
+ * Ҫһ÷ŵͷ
+ */
+static struct page *ramblock_lookup_page(sector_t sector)
+{
+	struct page *page;
+
+	spin_lock(&ramblock_pages_lock);
+	page = radix_tree_lookup(&ramblock_pages, sector >> PAGE_SECTORS_SHIFT);
+	if (page)
+		get_page(page);
+	spin_unlock(&ramblock_pages_lock);
+
+	return page;
+}
+
+/* ҵsectorڵҳ, ûеĻͷһ0ҳ; صҳ */
+static struct page *ramblock_insert_page(sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page;
+
+	page = ramblock_lookup_page(sector);
+	if (page)
+		return page;
+
+	page = alloc_page(RAMBLOCK_GFP);
+	if (!page)
+		return NULL;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_page(page);
+		return NULL;
+	}
+
+	spin_lock(&ramblock_pages_lock);
+	page->index = idx;
+	if (radix_tree_insert(&ramblock_pages, idx, page)) {
+		/* CPUȲͬһҳ */
+		__free_page(page);
+		page = radix_tree_lookup(&ramblock_pages, idx);
+		BUG_ON(!page);
+	} else {
+		ramblock_nr_pages++;
+	}
+	get_page(page);
+	spin_unlock(&ramblock_pages_lock);
+
+	radix_tree_preload_end();
+
+	return page;
+}
+
+/* ͳѹռõĿռ, ߳ramblock_pages_lock */
+static void ramblock_zaccount(struct ramblock_zpage *zp, int add)
+{
+	unsigned long mem = sizeof(*zp) + zp->len;
+
+	if (add) {
+		ramblock_compr_size += zp->len;
+		ramblock_mem_used += mem;
+		if (!zp->len)
+			ramblock_same_pages++;
+	} else {
+		ramblock_compr_size -= zp->len;
+		ramblock_mem_used -= mem;
+		if (!zp->len)
+			ramblock_same_pages--;
+	}
+}
+
+static void ramblock_free_entry(void *entry)
+{
+	if (ramblock_compress)
+		kfree(entry);
+	else
+		put_page(entry);	/* , ûþͷ */
+}
+
+/* ѹģʽµҪramblock_zmutex */
+static void ramblock_free_page(sector_t sector)
+{
+	void *entry;
+
+	spin_lock(&ramblock_pages_lock);
+	entry = radix_tree_delete(&ramblock_pages, sector >> PAGE_SECTORS_SHIFT);
+	if (entry) {
+		if (ramblock_compress)
+			ramblock_zaccount(entry, 0);
+		ramblock_nr_pages--;
+		ramblock_pages_freed++;
+	}
+	spin_unlock(&ramblock_pages_lock);
+
+	if (entry)
+		ramblock_free_entry(entry);
+}
+
+static pgoff_t ramblock_entry_index(void *entry)
+{
+	if (ramblock_compress)
+		return ((struct ramblock_zpage *)entry)->index;
+	else
+		return ((struct page *)entry)->index;
+}
+
+static void ramblock_free_pages(void)
+{
+	void *entries[FREE_BATCH];
+	unsigned long pos = 0;
+	int nr_pages;
+	int i;
+
+	do {
+		nr_pages = radix_tree_gang_lookup(&ramblock_pages,
+				entries, pos, FREE_BATCH);
+		for (i = 0; i < nr_pages; i++) {
+			pos = ramblock_entry_index(entries[i]);
+			radix_tree_delete(&ramblock_pages, pos);
+			ramblock_free_entry(entries[i]);
+		}
+		pos++;
+	} while (nr_pages == FREE_BATCH);
+}
+
+static int ramblock_is_zero(const void *buf, size_t n)
+{
+	const unsigned long *p = buf;
+	size_t i;
+
+	for (i = 0; i < n / sizeof(*p); i++)
+		if (p[i])
+			return 0;
+
+	return 1;
+}
+
+static int ramblock_page_same_filled(const void *buf, unsigned long *fill)
+{
+	const unsigned long *p = buf;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(*p); i++)
+		if (p[i] != p[0])
+			return 0;
+
+	*fill = p[0];
+	return 1;
+}
+
+/* zpԭһҳŵdst, zpΪNULLʾն */
+static int ramblock_zdecode(struct ramblock_zpage *zp, void *dst)
+{
+	unsigned long *p = dst;
+	unsigned int dlen = PAGE_SIZE;
+	unsigned int i;
+
+	if (!zp) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if (zp->len == 0) {
+		for (i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+			p[i] = zp->fill;
+		return 0;
+	}
+
+	if (zp->len == PAGE_SIZE) {
+		memcpy(dst, zp->data, PAGE_SIZE);
+		return 0;
+	}
+
+	if (crypto_comp_decompress(ramblock_tfm, zp->data, zp->len, dst, &dlen) ||
+	    dlen != PAGE_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+/* ѹһҳsrc, 滻ԭĶ; ȫ0ҳֱӱؿն */
+static int ramblock_zstore(pgoff_t idx, const void *src)
+{
+	struct ramblock_zpage *zp, *old;
+	const void *data = src;
+	unsigned int len = PAGE_SIZE;
+	unsigned int dlen = 2 * PAGE_SIZE;
+	unsigned long fill = 0;
+
+	if (ramblock_page_same_filled(src, &fill)) {
+		if (!fill) {
+			ramblock_free_page((sector_t)idx << PAGE_SECTORS_SHIFT);
+			return 0;
+		}
+		len = 0;
+	} else if (!crypto_comp_compress(ramblock_tfm, src, PAGE_SIZE,
+					 ramblock_cbuf, &dlen) &&
+		   dlen <= RAMBLOCK_MAX_ZSIZE) {
+		data = ramblock_cbuf;
+		len = dlen;
+	}
+
+	zp = kmalloc(sizeof(*zp) + len, GFP_NOIO);
+	if (!zp)
+		return -ENOMEM;
+	zp->index = idx;
+	zp->len = len;
+	zp->fill = fill;
+	memcpy(zp->data, data, len);
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		kfree(zp);
+		return -ENOMEM;
+	}
+
+	spin_lock(&ramblock_pages_lock);
+	old = radix_tree_delete(&ramblock_pages, idx);
+	if (old)
+		ramblock_zaccount(old, 0);
+	else
+		ramblock_nr_pages++;
+	radix_tree_insert(&ramblock_pages, idx, zp);
+	ramblock_zaccount(zp, 1);
+	spin_unlock(&ramblock_pages_lock);
+
+	radix_tree_preload_end();
+
+	kfree(old);
+	return 0;
+}
+
+/* ѹģʽд, nһҳ */
+static int ramblock_zwrite(sector_t sector, const void *src, size_t n)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+	int err;
+
+	mutex_lock(&ramblock_zmutex);
+	if (n < PAGE_SIZE) {
+		/* һҳ : Ƚѹԭҳ, ҳѹ */
+		err = ramblock_zdecode(radix_tree_lookup(&ramblock_pages, idx),
+				       ramblock_zbuf);
+		if (!err) {
+			memcpy(ramblock_zbuf + offset, src, n);
+			err = ramblock_zstore(idx, ramblock_zbuf);
+		}
+	} else {
+		err = ramblock_zstore(idx, src);
+	}
+	mutex_unlock(&ramblock_zmutex);
+
+	return err;
+}
+
+/* ѹģʽĶ, nһҳ */
+static int ramblock_zread(void *dst, sector_t sector, size_t n)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+	struct ramblock_zpage *zp;
+	int err;
+
+	mutex_lock(&ramblock_zmutex);
+	zp = radix_tree_lookup(&ramblock_pages, idx);
+	if (n < PAGE_SIZE) {
+		err = ramblock_zdecode(zp, ramblock_zbuf);
+		if (!err)
+			memcpy(dst, ramblock_zbuf + offset, n);
+	} else {
+		err = ramblock_zdecode(zp, dst);
+	}
+	mutex_unlock(&ramblock_zmutex);
+
+	return err;
+}
+
+/* ͨģʽд, nһҳ */
+static int ramblock_pwrite(sector_t sector, const void *src, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+	struct page *page;
+	void *dst;
+
+	page = ramblock_lookup_page(sector);
+	if (ramblock_is_zero(src, n) &&
+	    (!page || (n == PAGE_SIZE && !ramblock_xip_used))) {
+		/* д0 : ն0, ط; ҳд0ҳͷŵ */
+		if (page) {
+			put_page(page);
+			ramblock_free_page(sector);
+		}
+		return 0;
+	}
+
+	if (!page)
+		page = ramblock_insert_page(sector);
+	if (!page)
+		return -ENOMEM;
+
+	dst = kmap_atomic(page, KM_USER0);
+	memcpy(dst + offset, src, n);
+	kunmap_atomic(dst, KM_USER0);
+	put_page(page);
+
+	return 0;
+}
+
+/* ͨģʽĶ, nһҳ, նֱ0 */
+static int ramblock_pread(void *dst, sector_t sector, size_t n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+	struct page *page;
+	void *src;
+
+	page = ramblock_lookup_page(sector);
+	if (page) {
+		src = kmap_atomic(page, KM_USER0);
+		memcpy(dst, src + offset, n);
+		kunmap_atomic(src, KM_USER0);
+		put_page(page);
+	} else {
+		memset(dst, 0, n);
+	}
+
+	return 0;
+}
+
+/* д : srcʼnֽڿsector, ܿԽҳ */
+static int copy_to_ramblock(sector_t sector, const void *src, size_t n)
+{
+	while (n) {
+		unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+		size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+		int err;
+
+		if (ramblock_compress)
+			err = ramblock_zwrite(sector, src, copy);
+		else
+			err = ramblock_pwrite(sector, src, copy);
+		if (err)
+			return err;
+
+		sector += copy >> 9;
+		src += copy;
+		n -= copy;
+	}
+
+	return 0;
+}
+
+/*  : sectornֽڵdst */
+static int copy_from_ramblock(void *dst, sector_t sector, size_t n)
+{
+	while (n) {
+		unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+		size_t copy = min_t(size_t, n, PAGE_SIZE - offset);
+		int err;
+
+		if (ramblock_compress)
+			err = ramblock_zread(dst, sector, copy);
+		else
+			err = ramblock_pread(dst, sector, copy);
+		if (err)
+			return err;
+
+		sector += copy >> 9;
+		dst += copy;
+		n -= copy;
+	}
+
+	return 0;
+}
+
+/* discard : ֻͷҳ, һҳͷβԭ */
+static void discard_from_ramblock(sector_t sector, u64 n)
+{
+	unsigned int offset = (sector & (PAGE_SECTORS-1)) << 9;
+
+	if (offset) {
+		if (n <= PAGE_SIZE - offset)
+			return;
+		sector += (PAGE_SIZE - offset) >> 9;
+		n -= PAGE_SIZE - offset;
+	}
+
+	while (n >= PAGE_SIZE) {
+		if (ramblock_compress)
+			mutex_lock(&ramblock_zmutex);
+		ramblock_free_page(sector);
+		if (ramblock_compress)
+			mutex_unlock(&ramblock_zmutex);
+		sector += PAGE_SECTORS;
+		n -= PAGE_SIZE;
+		cond_resched();
+	}
+}
+
+static int ramblock_ioctl(struct inode *inode, struct file *file,
+			  unsigned int cmd, unsigned long arg)
+{
+	struct block_device *bdev = inode->i_bdev;
+	u64 start_sect = 0;
+	u64 nr_sects = get_capacity(ramblock_disk);
+	u64 range[2];
+
+	switch (cmd) {
+	case BLKDISCARD:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		if ((range[0] | range[1]) & 511)
+			return -EINVAL;
+		if (ramblock_xip_used)
+			return -EBUSY;
+
+		/* ڷϲʱ, ΧԷʼ */
+		if (bdev->bd_part) {
+			start_sect = bdev->bd_part->start_sect;
+			nr_sects = bdev->bd_part->nr_sects;
+		}
+		range[0] >>= 9;
+		range[1] >>= 9;
+		if (range[0] + range[1] < range[0] || range[0] + range[1] > nr_sects)
+			return -EINVAL;
+
+		discard_from_ramblock(start_sect + range[0], range[1] << 9);
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_EXT2_FS_XIP
+/*
+ * 2.6.22DAX : mount -t ext2 -o xip ʱ, ļread/write/mmap
+ * ֱʹﷵصҳַ, پpage cache࿽һ
+ */
+static int ramblock_direct_access(struct block_device *bdev, sector_t sector,
+				  unsigned long *data)
+{
+	struct page *page;
+
+	/* ѹģʽûпֱӳҳ */
+	if (ramblock_compress)
+		return -EOPNOTSUPP;
+
+	if (bdev->bd_part)
+		sector += bdev->bd_part->start_sect;
+	if (sector & (PAGE_SECTORS-1))
+		return -EINVAL;
+	if (sector + PAGE_SECTORS > get_capacity(bdev->bd_disk))
+		return -ERANGE;
+
+	page = ramblock_insert_page(sector);
+	if (!page)
+		return -ENOMEM;
+
+	ramblock_xip_used = 1;
+	*data = (unsigned long)page_address(page);
+	/* ùXIPԺͷҳ, һֱ */
+	put_page(page);
+
 	return 0;
 }
+#endif
 
 static struct block_device_operations ramblock_fops = {
 	.owner	= THIS_MODULE,
+	.ioctl	= ramblock_ioctl,
 	.getgeo 	= ramblock_getgeo,
+#ifdef CONFIG_EXT2_FS_XIP
+	.direct_access	= ramblock_direct_access,
+#endif
 };
 
+static void ramblock_account(int rw, unsigned int bytes, ktime_t start)
+{
+	struct ramblock_stats *st;
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	unsigned long us = ns > 0 ? (unsigned long)(ns >> 10) : 0;	/* Լus */
+	int bucket = min(fls(us), RAMBLOCK_LAT_BUCKETS - 1);
+
+	st = &get_cpu_var(ramblock_stats);
+	if (rw == READ) {
+		st->rd_ops++;
+		st->rd_bytes += bytes;
+	} else {
+		st->wr_ops++;
+		st->wr_bytes += bytes;
+	}
+	st->lat_hist[bucket]++;
+	put_cpu_var(ramblock_stats);
+}
 
-static void do_ramdisk_request (request_queue_t * q)
+/* cat /proc/ramblock */
+static int ramblock_read_proc(char *page, char **start, off_t off,
+			      int count, int *eof, void *data)
 {
-	static int r_cnt = 0;
-	static int w_cnt = 0;
-	struct request *req;
+	struct ramblock_stats sum;
+	int len = 0;
+	int cpu;
+	int i;
+
+	/* ѸCPUļ */
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		struct ramblock_stats *st = &per_cpu(ramblock_stats, cpu);
+
+		sum.rd_ops += st->rd_ops;
+		sum.wr_ops += st->wr_ops;
+		sum.rd_bytes += st->rd_bytes;
+		sum.wr_bytes += st->wr_bytes;
+		for (i = 0; i < RAMBLOCK_LAT_BUCKETS; i++)
+			sum.lat_hist[i] += st->lat_hist[i];
+	}
+
+	len += sprintf(page + len, "read_ops:    %lu\n", sum.rd_ops);
+	len += sprintf(page + len, "read_bytes:  %llu\n", sum.rd_bytes);
+	len += sprintf(page + len, "write_ops:   %lu\n", sum.wr_ops);
+	len += sprintf(page + len, "write_bytes: %llu\n", sum.wr_bytes);
+	for (i = 0; i < RAMBLOCK_LAT_BUCKETS - 1; i++)
+		len += sprintf(page + len, "lat_us <%-6u %lu\n",
+			       1U << i, sum.lat_hist[i]);
+	len += sprintf(page + len, "lat_us >=%-5u %lu\n",
+		       1U << (i - 1), sum.lat_hist[i]);
+
+	len += sprintf(page + len, "pages_used:  %lu\n", ramblock_nr_pages);
+	len += sprintf(page + len, "pages_freed: %lu\n", ramblock_pages_freed);
+	if (ramblock_compress) {
+		len += sprintf(page + len, "orig_data_size:  %lu\n",
+			       ramblock_nr_pages * PAGE_SIZE);
+		len += sprintf(page + len, "compr_data_size: %lu\n",
+			       ramblock_compr_size);
+		len += sprintf(page + len, "mem_used_total:  %lu\n",
+			       ramblock_mem_used);
+		len += sprintf(page + len, "same_pages:      %lu\n",
+			       ramblock_same_pages);
+	}
+
+	*eof = 1;
+	return len;
+}
 
-//	printk("do_ramdisk_request = %d \n",++cnt);
-	while ((req = elv_next_request(q)) != NULL)
+/* bioֱӴ : ݵ, ҲҪ, CPUύbioԲִ */
+static int ramblock_make_request(request_queue_t *q, struct bio *bio)
+{
+	/*ݴ3Ҫ : ԴĿģ*/
+	ktime_t start = ktime_get();
+	unsigned int bytes = bio->bi_size;
+	sector_t sector = bio->bi_sector;
+	struct bio_vec *bvec;
+	int rw = bio_rw(bio);
+	int err = 0;
+	int i;
+
+	if (sector + (bio->bi_size >> 9) > get_capacity(ramblock_disk))
 	{
-		/*ݴ3Ҫ : ԴĿģ*/
-		/*Դ/Ŀ*/
-		unsigned long offset = req->sector *512;
+		err = -EIO;
+		goto out;
+	}
 
-		/*Ŀ/Դ*/
-		//req->buffer
+	if (rw == READA)
+		rw = READ;
+
+	/*bvec, ÿbvecӦһҳ*/
+	bio_for_each_segment(bvec, bio, i)
+	{
 		/**/
-		unsigned long len  = req->current_nr_sectors *512;
+		unsigned int len = bvec->bv_len;
+		/*Ŀ/Դ : дʱҪҳ(), kmapkmap_atomic*/
+		void *mem = kmap(bvec->bv_page);
 
-		if (rq_data_dir(req) == READ)
+		if (rw == READ)
 		{
-			printk("do_ramdisk_request read = %d \n",++r_cnt);
-			memcpy(req->buffer, ramblock_buf+offset, len);
-			
+			err = copy_from_ramblock(mem + bvec->bv_offset, sector, len);
+			flush_dcache_page(bvec->bv_page);
 		}
 		else
 		{
-			printk("do_ramdisk_request wirte = %d \n",++w_cnt);
-			memcpy(ramblock_buf+offset,req->buffer,  len);
+			flush_dcache_page(bvec->bv_page);
+			err = copy_to_ramblock(sector, mem + bvec->bv_offset, len);
+		}
+		kunmap(bvec->bv_page);
+
+		if (err)
+			goto out;
+		sector += len >> 9;
+	}
+	ramblock_account(rw, bytes, start);
+out:
+	bio_endio(bio, bio->bi_size, err);
+	return 0;
+}
+
+/* *startʼһڵҳ, *startĳһε, ҳ */
+static unsigned int ramblock_next_extent(pgoff_t *start)
+{
+	void *entries[FREE_BATCH];
+	pgoff_t next = *start;
+	unsigned int count = 0;
+	int nr, i;
+
+	spin_lock(&ramblock_pages_lock);
+	do {
+		nr = radix_tree_gang_lookup(&ramblock_pages, entries, next, FREE_BATCH);
+		for (i = 0; i < nr; i++) {
+			pgoff_t idx = ramblock_entry_index(entries[i]);
+
+			if (count == 0)
+				*start = next = idx;
+			else if (idx != next)
+				goto out;
+			next++;
+			if (++count == RAMBLOCK_SNAP_MAX_EXTENT)
+				goto out;
+		}
+	} while (nr == FREE_BATCH);
+out:
+	spin_unlock(&ramblock_pages_lock);
+
+	return count;
+}
+
+/*  : һԪŵbuf, lenΪ0ʾ */
+static int ramblock_snap_get(struct ramblock_snap *snap)
+{
+	u32 *hdr = (u32 *)snap->buf;
+	int err = 0;
+
+	snap->pos = 0;
+	switch (snap->state) {
+	case SNAP_HEADER:
+		hdr[0] = RAMBLOCK_SNAP_MAGIC;
+		hdr[1] = RAMBLOCK_SNAP_VERSION;
+		hdr[2] = PAGE_SIZE;
+		hdr[3] = get_capacity(ramblock_disk) >> PAGE_SECTORS_SHIFT;
+		snap->len = 4 * sizeof(u32);
+		snap->state = SNAP_EXTENT;
+		break;
+
+	case SNAP_EXTENT:
+		snap->left = ramblock_next_extent(&snap->next);
+		hdr[0] = snap->next;
+		hdr[1] = snap->left;
+		snap->len = 2 * sizeof(u32);
+		snap->state = snap->left ? SNAP_DATA : SNAP_END;
+		break;
+
+	case SNAP_DATA:
+		err = copy_from_ramblock(snap->buf,
+				(sector_t)snap->next << PAGE_SECTORS_SHIFT, PAGE_SIZE);
+		snap->len = PAGE_SIZE;
+		snap->next++;
+		if (--snap->left == 0)
+			snap->state = SNAP_EXTENT;
+		break;
+
+	default:
+		snap->len = 0;
+		break;
+	}
+
+	return err;
+}
+
+/* ָ : bufһԪ,  */
+static int ramblock_snap_put(struct ramblock_snap *snap)
+{
+	pgoff_t nr_pages = get_capacity(ramblock_disk) >> PAGE_SECTORS_SHIFT;
+	u32 *hdr = (u32 *)snap->buf;
+	int err = 0;
+
+	switch (snap->state) {
+	case SNAP_HEADER:
+		if (hdr[0] != RAMBLOCK_SNAP_MAGIC ||
+		    hdr[1] != RAMBLOCK_SNAP_VERSION || hdr[2] != PAGE_SIZE)
+			return -EINVAL;
+		snap->state = SNAP_EXTENT;
+		break;
+
+	case SNAP_EXTENT:
+		if (hdr[1] == 0) {
+			snap->state = SNAP_END;
+			break;
+		}
+		if (hdr[0] >= nr_pages || hdr[1] > nr_pages - hdr[0])
+			return -ENOSPC;
+		snap->next = hdr[0];
+		snap->left = hdr[1];
+		snap->state = SNAP_DATA;
+		break;
+
+	case SNAP_DATA:
+		err = copy_to_ramblock((sector_t)snap->next << PAGE_SECTORS_SHIFT,
+				       snap->buf, PAGE_SIZE);
+		if (err)
+			return err;	/* ״̬, дһҳʱ */
+		snap->next++;
+		if (--snap->left == 0)
+			snap->state = SNAP_EXTENT;
+		break;
+	}
+
+	snap->pos = 0;
+	switch (snap->state) {
+	case SNAP_EXTENT:
+		snap->len = 2 * sizeof(u32);
+		break;
+	case SNAP_DATA:
+		snap->len = PAGE_SIZE;
+		break;
+	default:
+		snap->len = 0;
+		break;
+	}
+
+	return err;
+}
+
+static int ramblock_snap_open(struct inode *inode, struct file *file)
+{
+	struct ramblock_snap *snap;
+	int mode = file->f_flags & O_ACCMODE;
+
+	if (mode == O_RDWR)
+		return -EINVAL;
+	if (mode == O_WRONLY && ramblock_nr_pages)
+		return -EBUSY;
+	if (test_and_set_bit(0, &ramblock_snap_busy))
+		return -EBUSY;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap)
+		snap->buf = (unsigned char *)__get_free_page(GFP_KERNEL);
+	if (!snap || !snap->buf) {
+		kfree(snap);
+		clear_bit(0, &ramblock_snap_busy);
+		return -ENOMEM;
+	}
+
+	/* ָʱļͷ; ʱļͷڵһread */
+	snap->state = SNAP_HEADER;
+	if (mode == O_WRONLY)
+		snap->len = 4 * sizeof(u32);
+	file->private_data = snap;
+
+	return 0;
+}
+
+static int ramblock_snap_release(struct inode *inode, struct file *file)
+{
+	struct ramblock_snap *snap = file->private_data;
+
+	free_page((unsigned long)snap->buf);
+	kfree(snap);
+	clear_bit(0, &ramblock_snap_busy);
+
+	return 0;
+}
+
+static ssize_t ramblock_snap_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct ramblock_snap *snap = file->private_data;
+	size_t done = 0;
+	int err;
+
+	while (done < count) {
+		size_t n;
+
+		if (snap->pos == snap->len) {
+			err = ramblock_snap_get(snap);
+			if (err)
+				return done ? done : err;
+			if (!snap->len)
+				break;
+		}
+
+		n = min_t(size_t, count - done, snap->len - snap->pos);
+		if (copy_to_user(buf + done, snap->buf + snap->pos, n))
+			return done ? done : -EFAULT;
+		snap->pos += n;
+		done += n;
+	}
+
+	*ppos += done;
+	return done;
+}
+
+static ssize_t ramblock_snap_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct ramblock_snap *snap = file->private_data;
+	size_t done = 0;
+	int err;
+
+	while (done < count) {
+		size_t n;
+
+		if (snap->state == SNAP_END) {
+			err = -EINVAL;	/* Ǻ治Ӧ */
+			goto out;
+		}
+
+		n = min_t(size_t, count - done, snap->len - snap->pos);
+		if (copy_from_user(snap->buf + snap->pos, buf + done, n)) {
+			err = -EFAULT;
+			goto out;
 		}
-		
-		end_request(req, 1);	/* wrap up, 0 = fail, 1 = success */
-	}	
+		snap->pos += n;
+		done += n;
+
+		if (snap->pos == snap->len) {
+			err = ramblock_snap_put(snap);
+			if (err) {
+				/* һûдȥ, ˻ȥ, ´дʱύԪ */
+				snap->pos -= n;
+				done -= n;
+				goto out;
+			}
+		}
+	}
+
+	*ppos += done;
+	return done;
+
+out:
+	/* ǰѾдȥĲҪ, ȻӦóظύ */
+	*ppos += done;
+	return done ? done : err;
+}
+
+static struct file_operations ramblock_snap_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ramblock_snap_open,
+	.release	= ramblock_snap_release,
+	.read		= ramblock_snap_read,
+	.write		= ramblock_snap_write,
+};
+
+static int ramblock_zinit(void)
+{
+	ramblock_tfm = crypto_alloc_comp("deflate", 0, 0);
+	if (IS_ERR(ramblock_tfm))
+		return PTR_ERR(ramblock_tfm);
+
+	ramblock_zbuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	ramblock_cbuf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+	if (!ramblock_zbuf || !ramblock_cbuf) {
+		kfree(ramblock_zbuf);
+		kfree(ramblock_cbuf);
+		crypto_free_comp(ramblock_tfm);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void ramblock_zexit(void)
+{
+	kfree(ramblock_zbuf);
+	kfree(ramblock_cbuf);
+	crypto_free_comp(ramblock_tfm);
 }
+
 static int ramblock_init(void )
 {
+	int err;
+
+	/*0. ѹģʽ׼ѹ*/
+	if (ramblock_compress) {
+		err = ramblock_zinit();
+		if (err)
+			return err;
+	}
+
 	/*1. һgendiskṹ*/
 	ramblock_disk = alloc_disk(16);  /*豸 : +1 */
 
 	/*2. */
-	/*2.1 /öУṩд*/
-	ramblock_queue  =  blk_init_queue(do_ramdisk_request, &ramblock_lock);
+	/*2.1 /öУṩд : ֱӴbio*/
+	ramblock_queue  =  blk_alloc_queue(GFP_KERNEL);
+	blk_queue_make_request(ramblock_queue, ramblock_make_request);
 	ramblock_disk->queue = ramblock_queue;
 	
 	/*2.2  */
@@ -94,23 +1045,40 @@ static int ramblock_init(void )
 	ramblock_disk->first_minor =0;
 	sprintf(ramblock_disk->disk_name, "ramblock");
 	ramblock_disk->fops = &ramblock_fops;
-	set_capacity(ramblock_disk, RAMBLOCK_SIZE/512);
+	set_capacity(ramblock_disk, (sector_t)ramblock_mb << (20 - 9));
 
-	/*3. Ӳز*/
-	ramblock_buf = kzalloc(RAMBLOCK_SIZE, GFP_KERNEL);
+	/*3. Ӳز : Ԥȷڴ, ҳдʱ*/
 	/*4. ע*/
 	add_disk(ramblock_disk);
+
+	ramblock_proc = create_proc_entry("ramblock", S_IRUGO, &proc_root);
+	if (ramblock_proc)
+		ramblock_proc->read_proc = ramblock_read_proc;
+
+	/*5. /ָõַ豸 /dev/ramblock_snap*/
+	snap_major = register_chrdev(0, "ramblock_snap", &ramblock_snap_fops);
+	snap_cls = class_create(THIS_MODULE, "ramblock_snap");
+	class_device_create(snap_cls, NULL, MKDEV(snap_major, 0), NULL, "ramblock_snap");
 	
 	return 0;
 }
 static void ramblock_exit(void)
 {
+	class_device_destroy(snap_cls, MKDEV(snap_major, 0));
+	class_destroy(snap_cls);
+	unregister_chrdev(snap_major, "ramblock_snap");
+
+	if (ramblock_proc)
+		remove_proc_entry("ramblock", &proc_root);
+
 	unregister_blkdev(major,"ramblock");
 	del_gendisk(ramblock_disk);
 	put_disk(ramblock_disk);
     	blk_cleanup_queue( ramblock_queue );
 
-	kfree(ramblock_buf);
+	ramblock_free_pages();
+	if (ramblock_compress)
+		ramblock_zexit();
 }
 module_init(ramblock_init);
 module_exit(ramblock_exit);
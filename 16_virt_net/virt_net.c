@@ -18,25 +18,464 @@
 #include <linux/bitops.h>
 #include <linux/delay.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <linux/percpu.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <net/checksum.h>
+#include <net/ip6_checksum.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/sysfs.h>
+#include <net/dst.h>
 
 #include <asm/system.h>
 #include <asm/io.h>
 #include <asm/irq.h>
+#include <asm/div64.h>
 
+#define VNET_NAPI_WEIGHT	64	/* ÿpollϱİ */
+#define VNET_RXQ_LEN		1000	/* նг(Ĭ), ˾ͣͶ */
+
+/*
+ * ģ"·"Ĳ, װʱvnet0ĳֵ, ʱ
+ * /sys/class/net/vnet0/shaping/ °豸޸. ȫΪ0ʱԭ޿·
+ */
+static unsigned int delay_us;
+module_param(delay_us, uint, 0444);
+MODULE_PARM_DESC(delay_us, "one-way delay in microseconds (default 0)");
+
+static unsigned int jitter_us;
+module_param(jitter_us, uint, 0444);
+MODULE_PARM_DESC(jitter_us, "delay varies uniformly by +-jitter_us (default 0)");
+
+static unsigned int rate_kbps;
+module_param(rate_kbps, uint, 0444);
+MODULE_PARM_DESC(rate_kbps, "line rate in kbit/s, 0 = unlimited (default 0)");
+
+static unsigned int loss_ppm;
+module_param(loss_ppm, uint, 0444);
+MODULE_PARM_DESC(loss_ppm, "drop probability in parts per million (default 0)");
+
+static unsigned int limit = VNET_RXQ_LEN;
+module_param(limit, uint, 0444);
+MODULE_PARM_DESC(limit, "packets in flight before the tx queue stops (default 1000)");
+
+/* ͳưCPUֿ, Ͳ(LLTX), CPUͬʱ */
+struct vnet_stats {
+	unsigned long tx_packets;
+	unsigned long tx_bytes;
+	unsigned long rx_packets;
+	unsigned long rx_bytes;
+	unsigned long rx_dropped;	/* Ӧ治ʶ/Ӧİ */
+	unsigned long tx_dropped;	/* loss_ppm"·"϶ */
+};
+
+struct vnet_shape {
+	unsigned int delay_us;
+	unsigned int jitter_us;
+	unsigned int rate_kbps;
+	unsigned int loss_ppm;
+	unsigned int limit;
+};
+
+/* ӳٶİ, ʱskb->cb */
+struct vnet_skb_cb {
+	u64 time_to_send;	/* ns, CLOCK_MONOTONIC */
+};
+#define VNET_CB(skb)	((struct vnet_skb_cb *)(skb)->cb)
+
+struct vnet_priv {
+	struct net_device *dev;
+	struct sk_buff_head rxq;		/* "Ӳ"յİ, virt_net_pollϱ */
+	struct vnet_stats *stats;		/* alloc_percpu */
+
+	struct vnet_shape shape;
+	/*
+	 * ӳٶ: ʱź(Ƚȳ, ), ֻһhrtimer,
+	 * ڶͷʱ, ÿһʱ
+	 */
+	spinlock_t shape_lock;
+	struct sk_buff_head delayq;
+	struct hrtimer timer;
+	u64 line_free;			/* ns, ·һʱ() */
+	u64 last_send;			/* ns, βĵʱ, ӶҲ */
+};
 
 static struct net_device *vnet_dev;
 
+static inline int vnet_shaping(struct vnet_priv *priv)
+{
+	return priv->shape.delay_us || priv->shape.jitter_us ||
+	       priv->shape.rate_kbps;
+}
+
+static inline unsigned int vnet_inflight(struct vnet_priv *priv)
+{
+	return skb_queue_len(&priv->rxq) + skb_queue_len(&priv->delayq);
+}
+
+/*
+ * ӳٶеĶʱ: ѵİŲն, ٶ¶ͷʱ.
+ * ͬһʱ̵һֻһ
+ */
+static enum hrtimer_restart vnet_timer(struct hrtimer *timer)
+{
+	struct vnet_priv *priv = container_of(timer, struct vnet_priv, timer);
+	struct net_device *dev = priv->dev;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct sk_buff *skb;
+	unsigned long flags;
+	u64 now;
+	int moved = 0;
+
+	now = ktime_to_ns(ktime_get());
+	spin_lock_irqsave(&priv->shape_lock, flags);
+	while ((skb = skb_peek(&priv->delayq)) != NULL) {
+		if (VNET_CB(skb)->time_to_send > now) {
+			timer->expires = ns_to_ktime(VNET_CB(skb)->time_to_send);
+			ret = HRTIMER_RESTART;
+			break;
+		}
+		__skb_unlink(skb, &priv->delayq);
+		skb_queue_tail(&priv->rxq, skb);
+		moved++;
+	}
+	spin_unlock_irqrestore(&priv->shape_lock, flags);
+
+	if (moved)
+		netif_rx_schedule(dev);
+	return ret;
+}
+
+/*
+ * ʲôʱ""ն, Žӳٶ.
+ * ʱ = max(, ·) + ͺʱ + ӳ +- , Ҳǰһ
+ */
+static void vnet_delay_packet(struct vnet_priv *priv, struct sk_buff *skb)
+{
+	/* ʱܴsysfsĵ, ȡһ */
+	unsigned int jitter = priv->shape.jitter_us;
+	unsigned int rate = priv->shape.rate_kbps;
+	unsigned long flags;
+	u64 now, t, tx_ns;
+	s64 delay;
+
+	now = ktime_to_ns(ktime_get());
+	delay = (s64)priv->shape.delay_us * 1000;
+	if (jitter)
+		delay += ((s64)(random32() % (2 * jitter + 1)) - jitter) * 1000;
+	if (delay < 0)
+		delay = 0;
+
+	spin_lock_irqsave(&priv->shape_lock, flags);
+	t = now;
+	if (rate) {
+		/* ·ռõʱ: ֽ*8 /  */
+		tx_ns = (u64)(skb->len + ETH_HLEN) * 8 * 1000000;
+		do_div(tx_ns, rate);
+		if (priv->line_free > t)
+			t = priv->line_free;
+		t += tx_ns;
+		priv->line_free = t;
+	}
+	t += delay;
+	if (t < priv->last_send)
+		t = priv->last_send;
+	priv->last_send = t;
+
+	VNET_CB(skb)->time_to_send = t;
+	__skb_queue_tail(&priv->delayq, skb);
+	/* бǿյ, ʱû,  */
+	if (skb_queue_len(&priv->delayq) == 1)
+		hrtimer_start(&priv->timer, ns_to_ktime(t), HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&priv->shape_lock, flags);
+}
+
+/*
+ * ൱յݺж: Žն, NAPIpollϱ.
+ * ӳ/پȽӳٶ. ;İ˾ֹͣ, pollȡһٻ
+ */
+static void vnet_wire_rx(struct net_device *dev, struct sk_buff *skb)
+{
+	struct vnet_priv *priv = netdev_priv(dev);
+
+	if (vnet_shaping(priv) || skb_queue_len(&priv->delayq)) {
+		vnet_delay_packet(priv, skb);
+	} else {
+		skb_queue_tail(&priv->rxq, skb);
+		netif_rx_schedule(dev);
+	}
+	if (vnet_inflight(priv) >= priv->shape.limit) {
+		netif_stop_queue(dev);
+		/*
+		 * Ͳ(LLTX), жϺ֮ͣpollѾѶȡ,
+		 * лûͣ˳, Ժû˻. ͣԺٲһ
+		 */
+		smp_mb();
+		if (vnet_inflight(priv) <= priv->shape.limit / 2)
+			netif_wake_queue(dev);
+	}
+}
+
+/*
+ * Ӧ: ѷȥİԭظĳɻӦջ, skbҲ.
+ *   ICMP/ICMPv6 echo request -> echo reply
+ *   UDP                      -> ԭ(Ե˿)
+ *   TCP SYN                  -> SYN-ACK, TCP -> RST (RSTӦ)
+ * İ(Ƭ, Э, ICMP...)Ӧ, ֱӶ.
+ * ӦУ: ֻ˼ֶε, TCPͷɵľ;
+ * յԺҲټ(CHECKSUM_UNNECESSARY)
+ */
+
+/* Ĳͷָͳ(Ĳͷ+) */
+struct vnet_l4 {
+	unsigned char *hdr;
+	unsigned int len;
+	u8 proto;
+};
+
+/* skbѾԵ, ֻҪpʼlenֽûгβ */
+static inline int vnet_has(struct sk_buff *skb, unsigned char *p, unsigned int len)
+{
+	return p + len <= skb->data + skb->len;
+}
+
+/*
+ * дTCPͷ: յSYNSYN-ACK, ĻRST(RFC 793 "Reset Generation").
+ * ѡݶȥ, Ӧֻ20ֽڵTCPͷ. Ӧ-1
+ */
+static int vnet_tcp_reply(struct tcphdr *th, unsigned int len)
+{
+	u32 seq = ntohl(th->seq);
+	u32 ack_seq = ntohl(th->ack_seq);
+	unsigned int datalen = len - th->doff * 4;
+	int syn = th->syn, fin = th->fin, ack = th->ack;
+	__be16 port;
+
+	if (th->rst)
+		return -1;
+
+	port = th->source;
+	th->source = th->dest;
+	th->dest = port;
+	((u8 *)th)[13] = 0;	/* б־λ */
+	th->res1 = 0;
+	th->doff = sizeof(struct tcphdr) / 4;
+	th->urg_ptr = 0;
+
+	if (syn && !ack) {
+		th->syn = 1;
+		th->ack = 1;
+		th->seq = htonl(random32());
+		th->ack_seq = htonl(seq + 1);
+		th->window = htons(65535);
+	} else if (ack) {
+		th->rst = 1;
+		th->seq = htonl(ack_seq);
+		th->ack_seq = 0;
+		th->window = 0;
+	} else {
+		th->rst = 1;
+		th->ack = 1;
+		th->seq = 0;
+		th->ack_seq = htonl(seq + datalen + syn + fin);
+		th->window = 0;
+	}
+	th->check = 0;
+	return 0;
+}
+
+/*
+ * UDPTCP: Ե˿ڻTCPӦͷ.
+ * ػӦĲ㳤, Ӧ-1
+ */
+static int vnet_l4_reply(struct sk_buff *skb, struct vnet_l4 *l4)
+{
+	struct udphdr *uh;
+	__be16 port;
+
+	switch (l4->proto) {
+	case IPPROTO_UDP:
+		if (l4->len < sizeof(struct udphdr) ||
+		    !vnet_has(skb, l4->hdr, sizeof(struct udphdr)))
+			return -1;
+		/* αͷͶ˿ڶǶԵ, 16λ͵УͲ */
+		uh = (struct udphdr *)l4->hdr;
+		port = uh->source;
+		uh->source = uh->dest;
+		uh->dest = port;
+		return l4->len;
+
+	case IPPROTO_TCP:
+		if (l4->len < sizeof(struct tcphdr) ||
+		    !vnet_has(skb, l4->hdr, sizeof(struct tcphdr)) ||
+		    ((struct tcphdr *)l4->hdr)->doff * 4 < sizeof(struct tcphdr) ||
+		    ((struct tcphdr *)l4->hdr)->doff * 4 > l4->len)
+			return -1;
+		if (vnet_tcp_reply((struct tcphdr *)l4->hdr, l4->len))
+			return -1;
+		return sizeof(struct tcphdr);
+	}
+	return -1;
+}
+
+static int vnet_respond_ipv4(struct sk_buff *skb)
+{
+	struct iphdr *ih = (struct iphdr *)(skb->data + ETH_HLEN);
+	struct icmphdr *icmph;
+	struct vnet_l4 l4;
+	unsigned int ihl, tot_len;
+	__be32 addr;
+	int len;
+
+	if (!vnet_has(skb, (unsigned char *)ih, sizeof(struct iphdr)))
+		return -1;
+	ihl = ih->ihl * 4;
+	tot_len = ntohs(ih->tot_len);
+	if (ih->version != 4 || ihl < sizeof(struct iphdr) || tot_len < ihl ||
+	    tot_len > skb->len - ETH_HLEN ||
+	    !vnet_has(skb, (unsigned char *)ih, ihl))
+		return -1;
+	/* ƬӦ */
+	if (ih->frag_off & htons(IP_MF | IP_OFFSET))
+		return -1;
+
+	l4.hdr = (unsigned char *)ih + ihl;
+	l4.len = tot_len - ihl;
+	l4.proto = ih->protocol;
+
+	/* Ե"Դ/Ŀ"ipַ, Уǰ16λӵ, ԵԺ󲻱 */
+	addr = ih->saddr;
+	ih->saddr = ih->daddr;
+	ih->daddr = addr;
+
+	if (l4.proto == IPPROTO_ICMP) {
+		if (l4.len < sizeof(struct icmphdr) ||
+		    !vnet_has(skb, l4.hdr, sizeof(struct icmphdr)))
+			return -1;
+		icmph = (struct icmphdr *)l4.hdr;
+		if (icmph->type != ICMP_ECHO)
+			return -1;
+		// ޸, ԭ8ʾping, 0ʾreply; ICMPУֻĶ16λ
+		csum_replace2(&icmph->checksum, htons(ICMP_ECHO << 8),
+			      htons(ICMP_ECHOREPLY << 8));
+		icmph->type = ICMP_ECHOREPLY;
+		len = l4.len;
+	} else {
+		len = vnet_l4_reply(skb, &l4);
+		if (len < 0)
+			return -1;
+	}
+
+	/* TCPӦͷɵ, ȱ, IPTCPУͶҪ */
+	if (l4.proto == IPPROTO_TCP) {
+		ih->tot_len = htons(ihl + len);
+		ih->check = 0;
+		ih->check = ip_fast_csum((unsigned char *)ih, ih->ihl);
+		((struct tcphdr *)l4.hdr)->check =
+			csum_tcpudp_magic(ih->saddr, ih->daddr, len, IPPROTO_TCP,
+					  csum_partial(l4.hdr, len, 0));
+	}
+	skb_trim(skb, l4.hdr - skb->data + len);
+	return 0;
+}
+
+static int vnet_respond_ipv6(struct sk_buff *skb)
+{
+	struct ipv6hdr *ip6h = (struct ipv6hdr *)(skb->data + ETH_HLEN);
+	struct ipv6_opt_hdr *opt;
+	struct icmp6hdr *icmp6h;
+	struct in6_addr addr;
+	struct vnet_l4 l4;
+	unsigned int off, optlen;
+	int len;
+
+	if (!vnet_has(skb, (unsigned char *)ip6h, sizeof(struct ipv6hdr)))
+		return -1;
+	if (ip6h->version != 6 ||
+	    ntohs(ip6h->payload_len) > skb->len - ETH_HLEN - sizeof(struct ipv6hdr))
+		return -1;
+
+	/*
+	 * /Ŀѡչͷ. ·ͷ(ӦҪ)ͷƬͷ,
+	 * ͱЭһӦ
+	 */
+	off = sizeof(struct ipv6hdr);
+	l4.proto = ip6h->nexthdr;
+	while (l4.proto == IPPROTO_HOPOPTS || l4.proto == IPPROTO_DSTOPTS) {
+		opt = (struct ipv6_opt_hdr *)((unsigned char *)ip6h + off);
+		if (off + sizeof(*opt) > sizeof(struct ipv6hdr) + ntohs(ip6h->payload_len) ||
+		    !vnet_has(skb, (unsigned char *)opt, sizeof(*opt)))
+			return -1;
+		optlen = (opt->hdrlen + 1) * 8;
+		l4.proto = opt->nexthdr;
+		off += optlen;
+	}
+	if (off > sizeof(struct ipv6hdr) + ntohs(ip6h->payload_len))
+		return -1;
+	l4.hdr = (unsigned char *)ip6h + off;
+	l4.len = sizeof(struct ipv6hdr) + ntohs(ip6h->payload_len) - off;
+
+	addr = ip6h->saddr;
+	ip6h->saddr = ip6h->daddr;
+	ip6h->daddr = addr;
+
+	if (l4.proto == IPPROTO_ICMPV6) {
+		if (l4.len < sizeof(struct icmp6hdr) ||
+		    !vnet_has(skb, l4.hdr, sizeof(struct icmp6hdr)))
+			return -1;
+		icmp6h = (struct icmp6hdr *)l4.hdr;
+		if (icmp6h->icmp6_type != ICMPV6_ECHO_REQUEST)
+			return -1;
+		csum_replace2(&icmp6h->icmp6_cksum, htons(ICMPV6_ECHO_REQUEST << 8),
+			      htons(ICMPV6_ECHO_REPLY << 8));
+		icmp6h->icmp6_type = ICMPV6_ECHO_REPLY;
+		len = l4.len;
+	} else {
+		len = vnet_l4_reply(skb, &l4);
+		if (len < 0)
+			return -1;
+	}
+
+	if (l4.proto == IPPROTO_TCP) {
+		ip6h->payload_len = htons(off - sizeof(struct ipv6hdr) + len);
+		((struct tcphdr *)l4.hdr)->check =
+			csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, len, IPPROTO_TCP,
+					csum_partial(l4.hdr, len, 0));
+	}
+	skb_trim(skb, l4.hdr - skb->data + len);
+	return 0;
+}
+
+/*
+ * skbǶռ(Ѿskb_unshare), Ӧİͷ.
+ */
 static int emulator_rx_packet(struct sk_buff *skb, struct net_device *dev)
 {
 	/*οLDD3*/
-	unsigned char *type;
-	struct iphdr *ih;
-	__be32 *saddr, *daddr, tmp;
+	struct vnet_priv *priv = netdev_priv(dev);
 	unsigned char	tmp_dev_addr[ETH_ALEN];
 	struct ethhdr *ethhdr;
-	
-	struct sk_buff *rx_skb;
-		
+	int err = -1;
+
+	if (skb_linearize(skb) || skb->len < ETH_HLEN)
+		goto drop;
+	ethhdr = (struct ethhdr *)skb->data;
+	switch (ethhdr->h_proto) {
+	case __constant_htons(ETH_P_IP):
+		err = vnet_respond_ipv4(skb);
+		break;
+	case __constant_htons(ETH_P_IPV6):
+		err = vnet_respond_ipv6(skb);
+		break;
+	}
+	if (err)
+		goto drop;
+
 	// Ӳ/
 	/* Ե"Դ/Ŀ"macַ */
 	ethhdr = (struct ethhdr *)skb->data;
@@ -44,68 +483,220 @@ static int emulator_rx_packet(struct sk_buff *skb, struct net_device *dev)
 	memcpy(ethhdr->h_dest, ethhdr->h_source, ETH_ALEN);
 	memcpy(ethhdr->h_source, tmp_dev_addr, ETH_ALEN);
 
-	/* Ե"Դ/Ŀ"ipַ */    
-	ih = (struct iphdr *)(skb->data + sizeof(struct ethhdr));
-	saddr = &ih->saddr;
-	daddr = &ih->daddr;
-
-	tmp = *saddr;
-	*saddr = *daddr;
-	*daddr = tmp;
-	
-	//((u8 *)saddr)[2] ^= 1; /* change the third octet (class C) */
-	//((u8 *)daddr)[2] ^= 1;
-	type = skb->data + sizeof(struct ethhdr) + sizeof(struct iphdr);
-	//printk("tx package type = %02x\n", *type);
-	// ޸, ԭ0x8ʾping
-	*type = 0; /* 0ʾreply */
-	
-	ih->check = 0;		   /* and rebuild the checksum (ip needs it) */
-	ih->check = ip_fast_csum((unsigned char *)ih,ih->ihl);
-	
-	// һsk_buff
-	rx_skb = dev_alloc_skb(skb->len + 2);
-	skb_reserve(rx_skb, 2); /* align IP on 16B boundary */	
-	memcpy(skb_put(rx_skb, skb->len), skb->data, skb->len);
-
-	/* Write metadata, and then pass to the receive level */
-	rx_skb->dev = dev;
-	rx_skb->protocol = eth_type_trans(rx_skb, dev);
-	rx_skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	dev->stats.rx_packets++;
-	dev->stats.rx_bytes += skb->len;
-
-	// ύsk_buff
-	netif_rx(rx_skb);
+	/*
+	 * ·µĶҪ: ·(ַѾԵ, Ҫ²),
+	 * socket(Ȼһֱռŷͷsndbuf), netfilter״̬
+	 */
+	dst_release(skb->dst);
+	skb->dst = NULL;
+	skb_orphan(skb);
+	nf_reset(skb);
+
+	/* Write metadata */
+	skb->dev = dev;
+	skb->protocol = eth_type_trans(skb, dev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+
+	vnet_wire_rx(dev, skb);
+	return 0;
+
+drop:
+	per_cpu_ptr(priv->stats, smp_processor_id())->rx_dropped++;
+	dev_kfree_skb(skb);
+	return -EINVAL;
+}
+
+/* NAPI poll : жѽնİЭջ */
+static int virt_net_poll(struct net_device *dev, int *budget)
+{
+	struct vnet_priv *priv = netdev_priv(dev);
+	struct vnet_stats *stats;
+	int quota = min(dev->quota, *budget);
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	stats = per_cpu_ptr(priv->stats, smp_processor_id());
+	while (work_done < quota && (skb = skb_dequeue(&priv->rxq)) != NULL) {
+		stats->rx_packets++;
+		stats->rx_bytes += skb->len + ETH_HLEN;
+		netif_receive_skb(skb);
+		work_done++;
+	}
+
+	dev->quota -= work_done;
+	*budget -= work_done;
+
+	/* vnet_wire_rxͣкļ */
+	smp_mb();
+	if (netif_queue_stopped(dev) &&
+	    vnet_inflight(priv) <= priv->shape.limit / 2)
+		netif_wake_queue(dev);
+
+	if (!skb_queue_empty(&priv->rxq))
+		return 1;
+
+	/* п˾˳ѯ; ˳ǰ˰Ļ¹һȥ */
+	netif_rx_complete(dev);
+	if (!skb_queue_empty(&priv->rxq) && netif_rx_reschedule(dev, 0))
+		return 1;
+	return 0;
 }
 
 static int virt_net_send_packet(struct sk_buff *skb, struct net_device *dev)
 {
-	static int cnt = 0;
-	printk("virt net send packet cnt = %d\n",++cnt);
+	struct vnet_priv *priv = netdev_priv(dev);
+	struct vnet_stats *stats;
 
 	/* ʵskbͨͳȥ */
-	netif_stop_queue(dev); /*ֹͣĶ*/
 	/*...........*/		   /* skbд*/
 
-	/*һٵ sk_buff ϱ */
+	/* ͳϢ, Ҫڸдskb֮ǰ */
+	stats = per_cpu_ptr(priv->stats, get_cpu());
+	stats->tx_packets++;
+	stats->tx_bytes += skb->len;
+	put_cpu();
+	dev->trans_start = jiffies;
+
+	/* ģ· */
+	if (priv->shape.loss_ppm && random32() % 1000000 < priv->shape.loss_ppm) {
+		per_cpu_ptr(priv->stats, smp_processor_id())->tx_dropped++;
+		dev_kfree_skb(skb);
+		return 0;
+	}
+
+	/*
+	 * skbֱӸĳɻӦϱ. ֻбclone(tcpdumpҲһ)
+	 * Ҫһ, ԭ޸, ٸ
+	 */
+	skb = skb_unshare(skb, GFP_ATOMIC);
+	if (!skb) {
+		stats = per_cpu_ptr(priv->stats, smp_processor_id());
+		stats->rx_dropped++;
+		return 0;
+	}
 	emulator_rx_packet(skb, dev);
-	
-	dev_kfree_skb (skb); 	/*ͷskb */	
-	netif_wake_queue(dev);	/* ѸĶ */
-	/* ͳϢ */
-	dev->stats.tx_packets++;
-	dev->stats.tx_bytes += skb->len;
-	
+
+	return 0;
+}
+
+static struct net_device_stats *virt_net_get_stats(struct net_device *dev)
+{
+	struct vnet_priv *priv = netdev_priv(dev);
+	struct net_device_stats *stats = &dev->stats;
+	struct vnet_stats *s;
+	int cpu;
+
+	stats->tx_packets = stats->tx_bytes = 0;
+	stats->rx_packets = stats->rx_bytes = stats->rx_dropped = 0;
+	stats->tx_dropped = 0;
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(priv->stats, cpu);
+		stats->tx_packets += s->tx_packets;
+		stats->tx_bytes   += s->tx_bytes;
+		stats->rx_packets += s->rx_packets;
+		stats->rx_bytes   += s->rx_bytes;
+		stats->rx_dropped += s->rx_dropped;
+		stats->tx_dropped += s->tx_dropped;
+	}
+	return stats;
+}
+
+static int virt_net_open(struct net_device *dev)
+{
+	struct vnet_priv *priv = netdev_priv(dev);
+
+	priv->line_free = priv->last_send = 0;
+	netif_start_queue(dev);
+	return 0;
+}
+
+static int virt_net_stop(struct net_device *dev)
+{
+	struct vnet_priv *priv = netdev_priv(dev);
+
+	netif_stop_queue(dev);
+	hrtimer_cancel(&priv->timer);
+	/* dev_closeѾpoll, ʣµİֱӶ */
+	skb_queue_purge(&priv->delayq);
+	skb_queue_purge(&priv->rxq);
 	return 0;
 }
+
+/* /sys/class/net/vnetX/shaping/ µĲ, дһЧ */
+#define VNET_SHAPE_ATTR(field, min)					\
+static ssize_t show_##field(struct class_device *cd, char *buf)	\
+{									\
+	struct vnet_priv *priv = netdev_priv(to_net_dev(cd));		\
+	return sprintf(buf, "%u\n", priv->shape.field);		\
+}									\
+static ssize_t store_##field(struct class_device *cd,			\
+			     const char *buf, size_t len)		\
+{									\
+	struct vnet_priv *priv = netdev_priv(to_net_dev(cd));		\
+	char *end;							\
+	unsigned long val = simple_strtoul(buf, &end, 0);		\
+									\
+	if (end == buf || val < (min) || val > UINT_MAX)		\
+		return -EINVAL;						\
+	priv->shape.field = val;					\
+	return len;							\
+}									\
+static CLASS_DEVICE_ATTR(field, 0644, show_##field, store_##field)
+
+VNET_SHAPE_ATTR(delay_us, 0);
+VNET_SHAPE_ATTR(jitter_us, 0);
+VNET_SHAPE_ATTR(rate_kbps, 0);
+VNET_SHAPE_ATTR(loss_ppm, 0);
+VNET_SHAPE_ATTR(limit, 1);
+
+static struct attribute *vnet_shape_attrs[] = {
+	&class_device_attr_delay_us.attr,
+	&class_device_attr_jitter_us.attr,
+	&class_device_attr_rate_kbps.attr,
+	&class_device_attr_loss_ppm.attr,
+	&class_device_attr_limit.attr,
+	NULL
+};
+
+static struct attribute_group vnet_shape_group = {
+	.name  = "shaping",
+	.attrs = vnet_shape_attrs,
+};
+
 static int virt_net_init(void)
 {
-	/*1. һnet_deviceṹ */
-	vnet_dev = alloc_netdev(0, "vnet%d", ether_setup);;
+	struct vnet_priv *priv;
+	int err;
+
+	/*1. һnet_deviceṹ, vnet_priv */
+	vnet_dev = alloc_netdev(sizeof(struct vnet_priv), "vnet%d", ether_setup);
+	if (!vnet_dev)
+		return -ENOMEM;
+	priv = netdev_priv(vnet_dev);
+	priv->dev = vnet_dev;
+	skb_queue_head_init(&priv->rxq);
+	skb_queue_head_init(&priv->delayq);
+	spin_lock_init(&priv->shape_lock);
+	hrtimer_init(&priv->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	priv->timer.function = vnet_timer;
+	priv->shape.delay_us  = delay_us;
+	priv->shape.jitter_us = jitter_us;
+	priv->shape.rate_kbps = rate_kbps;
+	priv->shape.loss_ppm  = loss_ppm;
+	priv->shape.limit     = limit ? limit : VNET_RXQ_LEN;
+	priv->stats = alloc_percpu(struct vnet_stats);
+	if (!priv->stats) {
+		free_netdev(vnet_dev);
+		return -ENOMEM;
+	}
 
 	/*2.  */
+	vnet_dev->open            = virt_net_open;
+	vnet_dev->stop            = virt_net_stop;
 	vnet_dev->hard_start_xmit = virt_net_send_packet;
+	vnet_dev->get_stats       = virt_net_get_stats;
+	vnet_dev->poll            = virt_net_poll;
+	vnet_dev->weight          = VNET_NAPI_WEIGHT;
 	/* MAC */
 	vnet_dev->dev_addr[0] = 0x08;
     vnet_dev->dev_addr[1] = 0x89;
@@ -113,18 +704,36 @@ static int virt_net_init(void)
     vnet_dev->dev_addr[3] = 0x89;
     vnet_dev->dev_addr[4] = 0x89;
     vnet_dev->dev_addr[5] = 0x89;
-	
+
     /* pingͨ */
 	vnet_dev->flags           |= IFF_NOARP;
-	vnet_dev->features        |= NETIF_F_NO_CSUM;	
+	vnet_dev->features        |= NETIF_F_NO_CSUM;
+	/* ͺﲻ, CPU */
+	vnet_dev->features        |= NETIF_F_LLTX;
 	/*3. ע */
-	register_netdev(vnet_dev);
+	err = register_netdev(vnet_dev);
+	if (err)
+		goto err_free;
+	err = sysfs_create_group(&vnet_dev->class_dev.kobj, &vnet_shape_group);
+	if (err) {
+		unregister_netdev(vnet_dev);
+		goto err_free;
+	}
 	return 0;
+
+err_free:
+	free_percpu(priv->stats);
+	free_netdev(vnet_dev);
+	return err;
 }
 
 static void virt_net_exit(void)
 {
+	struct vnet_priv *priv = netdev_priv(vnet_dev);
+
+	sysfs_remove_group(&vnet_dev->class_dev.kobj, &vnet_shape_group);
 	unregister_netdev(vnet_dev);
+	free_percpu(priv->stats);
 	free_netdev(vnet_dev);
 }
 
@@ -132,6 +741,3 @@ module_init(virt_net_init);
 module_exit(virt_net_exit);
 
 MODULE_LICENSE("GPL");
-
-
-
@@ -56,7 +56,6 @@ V2.09 05/24/2007	-support ethtool and mii-tool
 
 */
 
-//#define CHECKSUM
 //#define TDBUG		/* check TX FIFO pointer */
 //#define RDBUG   /* check RX FIFO pointer */
 //#define DM8606
@@ -83,6 +82,7 @@ V2.09 05/24/2007	-support ethtool and mii-tool
 #include <linux/crc32.h>
 #include <linux/mii.h>
 #include <linux/ethtool.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
 
 #ifdef CONFIG_ARCH_MAINSTONE
@@ -94,7 +94,11 @@ V2.09 05/24/2007	-support ethtool and mii-tool
 #include <asm/delay.h>
 #include <asm/irq.h>
 #include <asm/io.h>
+#ifdef DM9KS_EMU
+#include "dm9000c_emu.h"	/* software DM9000, see dm9000c_emu.c */
+#else
 #include <asm/arch-s3c2410/regs-mem.h>
+#endif
 
 
 /* Board/System/Debug information/definition ---------------- */
@@ -105,6 +109,8 @@ V2.09 05/24/2007	-support ethtool and mii-tool
 #define DM9KS_NCR		0x00	/* Network control Reg.*/
 #define DM9KS_NSR		0x01	/* Network Status Reg.*/
 #define DM9KS_TCR		0x02	/* TX control Reg.*/
+#define DM9KS_TSR1		0x03	/* TX status Reg. I */
+#define DM9KS_TSR2		0x04	/* TX status Reg. II */
 #define DM9KS_RXCR		0x05	/* RX control Reg.*/
 #define DM9KS_BPTR		0x08
 #define DM9KS_FCTR		0x09
@@ -167,10 +173,16 @@ V2.09 05/24/2007	-support ethtool and mii-tool
 
 #define TRUE			1
 #define FALSE			0
-/* Number of continuous Rx packets */
-#define CONT_RX_PKT_CNT		0xFFFF
 
-#define DMFE_TIMER_WUT  jiffies+(HZ*5)	/* timer wakeup time : 5 second */
+#define DMFE_NAPI_WEIGHT	16	/* RX frames per dmfe_poll() call */
+#define DMFE_PHY_POLL		(HZ)	/* link poll period */
+#define DMFE_PHY_AN_DELAY	(HZ/5)	/* wait for auto-negotiation result */
+
+#define DMFE_COPYBREAK		256	/* frames up to this go to the small pool */
+#define DMFE_RXBUF_SMALL	(DMFE_COPYBREAK + 4 + 2)
+#define DMFE_RXBUF_LARGE	(1536 + 4 + 2)
+#define DMFE_POOL_SMALL		32	/* preallocated skbs per pool */
+#define DMFE_POOL_LARGE		32
 
 #ifdef DM9KS_DEBUG
 #define DMFE_DBUG(dbug_now, msg, vaule)\
@@ -207,6 +219,12 @@ enum DM9KS_PHY_mode {
 	DM9KS_AUTO    = 8, 
 };
 
+enum dmfe_phy_state {
+	DMFE_PHY_DOWN,		/* no link */
+	DMFE_PHY_AN_WAIT,	/* link up, speed not yet resolved */
+	DMFE_PHY_UP,		/* link up, Speed valid */
+};
+
 /* Structure/enum declaration ------------------------------- */
 typedef struct board_info { 
 	u32 io_addr;/* Register I/O base address */
@@ -216,14 +234,58 @@ typedef struct board_info {
 	u8 Speed;	/* current speed */
 	u8 chip_revision;
 	int rx_csum;/* 0:disable, 1:enable */
+	int csum_hw;	/* chip has the checksum engine (DM9000A/B, DM9010) */
+	int tccr_on;	/* TCCR currently programmed for TX checksum */
 	
 	u32 reset_counter;/* counter: RESET */ 
 	u32 reset_tx_timeout;/* RESET caused by TX Timeout */
-	int tx_pkt_cnt;
-	int cont_rx_pkt_cnt;/* current number of continuos rx packets  */
+	int tx_pkt_cnt;	/* frames in TX SRAM, at most dmfe_tx_max() */
+	u16 queue_pkt_len;	/* length of the frame waiting behind the one on the wire */
+	int queue_pkt_csum;	/* and whether it wants checksum insertion */
+
+	/* address filter as last written, only changed bytes are rewritten */
+	u8 rxcr;
+	u8 par[6];
+	u8 mar[8];
+	int filter_valid;	/* 0 : chip was reset, rewrite everything */
+	u8 imr;		/* current IMR value, RX masked while polling */
+	int phy_state;	/* enum dmfe_phy_state */
+	struct delayed_work phy_work;	/* periodic link poll */
+	struct work_struct link_work;	/* link change interrupt */
+
+	/* RX skb pools, filled from rx_refill_work with GFP_KERNEL */
+	struct sk_buff_head rx_pool_small;
+	struct sk_buff_head rx_pool_large;
+	struct work_struct rx_refill_work;
+	u32 rx_pool_hit;	/* skb taken from a pool */
+	u32 rx_pool_miss;	/* pool empty, dev_alloc_skb() fallback */
+	u32 rx_copybreak;	/* frames placed in small skbs */
+	u32 rx_pool_drop;	/* pool empty and allocation failed */
+
+	/* per-cause error and event counters, read by ethtool -S */
+	u32 rx_fifo_err;	/* RSR bit0 FOE */
+	u32 rx_crc_err;		/* RSR bit1 CE */
+	u32 rx_align_err;	/* RSR bit2 AE */
+	u32 rx_phy_err;		/* RSR bit3 PLE */
+	u32 rx_wdt_err;		/* RSR bit4 RWTO */
+	u32 rx_late_coll;	/* RSR bit5 LCS */
+	u32 rx_runt;		/* RSR bit7 RF */
+	u32 rx_ready_err;	/* bad RX ready byte, chip reset */
+	u32 tx_jabber;		/* TSR bit7 TJTO */
+	u32 tx_loss_carrier;	/* TSR bit6 LC */
+	u32 tx_no_carrier;	/* TSR bit5 NC */
+	u32 tx_late_coll;	/* TSR bit4 LC */
+	u32 tx_coll;		/* TSR bit3 COL */
+	u32 tx_excess_coll;	/* TSR bit2 EC */
+	u32 tx_cnt_err;		/* NSR reported more completions than queued */
+	u32 irq_count;
+	u32 irq_rx;
+	u32 irq_tx;
+	u32 irq_link;
+	u32 poll_count;		/* dmfe_poll() calls */
+	u32 poll_complete;	/* dmfe_poll() calls that emptied the SRAM */
 	struct net_device_stats stats;
 	
-	struct timer_list timer;
 	unsigned char srom[128];
 	spinlock_t lock;
 	struct mii_if_info mii;
@@ -283,12 +345,78 @@ u32 inl(u32 ioaddr)
 }
 #endif
 
+/*
+  SRAM data port block moves. io_data is the ioremap()ed data port, so
+  the string accessors can keep it in a register and move the buffer
+  side with ldm/stm bursts instead of one call per bus cycle.
+*/
+static inline void dmfe_outblk(board_info_t *db, void *data, int count)
+{
+	void __iomem *port = (void __iomem *)db->io_data;
+
+	switch (db->io_mode)
+	{
+		case DM9KS_BYTE_MODE:
+			writesb(port, data, count);
+			break;
+		case DM9KS_WORD_MODE:
+			writesw(port, data, (count + 1) >> 1);
+			break;
+		case DM9KS_DWORD_MODE:
+			writesl(port, data, (count + 3) >> 2);
+			break;
+	}
+}
+
+static inline void dmfe_inblk(board_info_t *db, void *data, int count)
+{
+	void __iomem *port = (void __iomem *)db->io_data;
+
+	switch (db->io_mode)
+	{
+		case DM9KS_BYTE_MODE:
+			readsb(port, data, count);
+			break;
+		case DM9KS_WORD_MODE:
+			readsw(port, data, (count + 1) >> 1);
+			break;
+		case DM9KS_DWORD_MODE:
+			readsl(port, data, (count + 3) >> 2);
+			break;
+	}
+}
+
+/* discard count bytes from the RX SRAM */
+static inline void dmfe_dumpblk(board_info_t *db, int count)
+{
+	int i;
+
+	switch (db->io_mode)
+	{
+		case DM9KS_BYTE_MODE:
+			for (i = 0; i < count; i++)
+				inb(db->io_data);
+			break;
+		case DM9KS_WORD_MODE:
+			count = (count + 1) >> 1;
+			for (i = 0; i < count; i++)
+				inw(db->io_data);
+			break;
+		case DM9KS_DWORD_MODE:
+			count = (count + 3) >> 2;
+			for (i = 0; i < count; i++)
+				inl(db->io_data);
+			break;
+	}
+}
+
 /* function declaration ------------------------------------- */
 int dmfe_probe1(struct net_device *);
 static int dmfe_open(struct net_device *);
 static int dmfe_start_xmit(struct sk_buff *, struct net_device *);
 static void dmfe_tx_done(unsigned long);
-static void dmfe_packet_receive(struct net_device *);
+static int dmfe_packet_receive(struct net_device *, struct sk_buff **);
+static int dmfe_poll(struct net_device *, int *);
 static int dmfe_stop(struct net_device *);
 static struct net_device_stats * dmfe_get_stats(struct net_device *); 
 static int dmfe_do_ioctl(struct net_device *, struct ifreq *, int);
@@ -301,17 +429,23 @@ static void dmfe_interrupt(int , void *, struct pt_regs *);
 	static irqreturn_t dmfe_interrupt(int , void *);/* for kernel 2.6.20 */
 	#endif
 #endif
-static void dmfe_timer(unsigned long);
 static void dmfe_init_dm9000(struct net_device *);
-static unsigned long cal_CRC(unsigned char *, unsigned int, u8);
+static void dmfe_crc_init(void);
+static u32 dmfe_crc_addr(const u8 *);
 u8 ior(board_info_t *, int);
 void iow(board_info_t *, int, u8);
 static u16 phy_read(board_info_t *, int);
 static void phy_write(board_info_t *, int, u16);
 static u16 read_srom_word(board_info_t *, int);
+static void __dm9000_hash_table(struct net_device *);
 static void dm9000_hash_table(struct net_device *);
+static void dmfe_write_rxcr(board_info_t *, u8);
 static void dmfe_timeout(struct net_device *);
 static void dmfe_reset(struct net_device *);
+static void dmfe_phy_work(struct work_struct *);
+static void dmfe_link_work(struct work_struct *);
+static void dmfe_rx_refill(board_info_t *);
+static void dmfe_rx_refill_work(struct work_struct *);
 static int mdio_read(struct net_device *, int, int);
 static void mdio_write(struct net_device *, int, int, int);
 static void dmfe_get_drvinfo(struct net_device *, struct ethtool_drvinfo *);
@@ -323,6 +457,9 @@ static uint32_t dmfe_get_rx_csum(struct net_device *);
 static uint32_t dmfe_get_tx_csum(struct net_device *);
 static int dmfe_set_rx_csum(struct net_device *, uint32_t );
 static int dmfe_set_tx_csum(struct net_device *, uint32_t );
+static int dmfe_get_stats_count(struct net_device *);
+static void dmfe_get_strings(struct net_device *, u32, u8 *);
+static void dmfe_get_ethtool_stats(struct net_device *, struct ethtool_stats *, u64 *);
 
 #ifdef DM8606
 #include "dm8606.h"
@@ -410,6 +547,17 @@ int __init dmfe_probe1(struct net_device *dev)
 			db->io_addr  = iobase;
 			db->io_data = iobase + 4;   
 			db->chip_revision = ior(db, DM9KS_CHIPR);
+			db->csum_hw = (id_val == DM9010_ID || db->chip_revision >= 0x19);
+#ifdef DM9KS_EMU
+			/* the emulator reports 0x1a but models neither TCCR nor RCSR */
+			db->csum_hw = 0;
+#endif
+			spin_lock_init(&db->lock);
+			INIT_DELAYED_WORK(&db->phy_work, dmfe_phy_work);
+			INIT_WORK(&db->link_work, dmfe_link_work);
+			skb_queue_head_init(&db->rx_pool_small);
+			skb_queue_head_init(&db->rx_pool_large);
+			INIT_WORK(&db->rx_refill_work, dmfe_rx_refill_work);
 			
 			chip_info = ior(db,0x43);
 //			if((db->chip_revision!=0x1A) || ((chip_info&(1<<5))!=0) || ((chip_info&(1<<2))!=1)) return -ENODEV;
@@ -425,13 +573,16 @@ int __init dmfe_probe1(struct net_device *dev)
 			dev->get_stats 		= &dmfe_get_stats;
 			dev->set_multicast_list = &dm9000_hash_table;
 			dev->do_ioctl 		= &dmfe_do_ioctl;
+			dev->poll		= &dmfe_poll;
+			dev->weight		= DMFE_NAPI_WEIGHT;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,4,28)
 			dev->ethtool_ops = &dmfe_ethtool_ops;
 #endif
-#ifdef CHECKSUM
-			//dev->features |=  NETIF_F_IP_CSUM;
-			dev->features |=  NETIF_F_IP_CSUM|NETIF_F_SG;
-#endif
+			/* IPv4 TCP/UDP only, and frames are copied linear : no SG */
+			if (db->csum_hw) {
+				dev->features |= NETIF_F_IP_CSUM;
+				db->rx_csum = 1;
+			}
 			db->mii.dev = dev;
 			db->mii.mdio_read = mdio_read;
 			db->mii.mdio_write = mdio_write;
@@ -475,14 +626,16 @@ int __init dmfe_probe1(struct net_device *dev)
 static int dmfe_open(struct net_device *dev)
 {
 	board_info_t *db = (board_info_t *)dev->priv;
-	u8 reg_nsr;
-	int i;
 	DMFE_DBUG(0, "dmfe_open", 0);
 
 	if (request_irq(dev->irq,&dmfe_interrupt,IRQF_TRIGGER_RISING,dev->name,dev)) 
 		return -EAGAIN;
 
+	/* fill the RX pools before the first frame can arrive */
+	dmfe_rx_refill(db);
+
 	/* Initilize DM910X board */
+	db->imr = DM9KS_REGFF;
 	dmfe_init_dm9000(dev);
 #ifdef DM8606
 	// control DM8606
@@ -492,34 +645,12 @@ static int dmfe_open(struct net_device *dev)
 	/* Init driver variable */
 	db->reset_counter 	= 0;
 	db->reset_tx_timeout 	= 0;
-	db->cont_rx_pkt_cnt	= 0;
 	
-	/* check link state and media speed */
+	/* link state and media speed are resolved by dmfe_phy_work() */
 	db->Speed =10;
-	i=0;
-	do {
-		reg_nsr = ior(db,DM9KS_NSR);
-		if(reg_nsr & 0x40) /* link OK!! */
-		{
-			/* wait for detected Speed */
-			mdelay(200);
-			reg_nsr = ior(db,DM9KS_NSR);
-			if(reg_nsr & 0x80)
-				db->Speed =10;
-			else
-				db->Speed =100;
-			break;
-		}
-		i++;
-		mdelay(1);
-	}while(i<3000);	/* wait 3 second  */
-	//printk("i=%d  Speed=%d\n",i,db->Speed);	
-	/* set and active a timer process */
-	init_timer(&db->timer);
-	db->timer.expires 	= DMFE_TIMER_WUT;
-	db->timer.data 		= (unsigned long)dev;
-	db->timer.function 	= &dmfe_timer;
-	add_timer(&db->timer);	//Move to DM9000 initiallization was finished.
+	db->phy_state = DMFE_PHY_DOWN;
+	netif_carrier_off(dev);
+	schedule_delayed_work(&db->phy_work, 0);
  	
 	netif_start_queue(dev);
 
@@ -660,8 +791,6 @@ static void dmfe_init_dm9000(struct net_device *dev)
 	board_info_t *db = (board_info_t *)dev->priv;
 	DMFE_DBUG(0, "dmfe_init_dm9000()", 0);
 
-	spin_lock_init(&db->lock);
-	
 	iow(db, DM9KS_GPR, 0);	/* GPR (reg_1Fh)bit GPIO0=0 pre-activate PHY */
 	mdelay(20);		/* wait for PHY power-on ready */
 
@@ -700,14 +829,12 @@ static void dmfe_init_dm9000(struct net_device *dev)
 	iow(db,0x34,1);
 #endif
 
-	if (dev->features & NETIF_F_HW_CSUM){
-		printk(KERN_INFO "DM9KS:enable TX checksum\n");
-		iow(db, DM9KS_TCCR, 0x07);	/* TX UDP/TCP/IP checksum enable */
-	}
-	if (db->rx_csum){
-		printk(KERN_INFO "DM9KS:enable RX checksum\n");
-		iow(db, DM9KS_RCSR, 0x02);	/* RX checksum enable */
+	if (db->csum_hw) {
+		/* TX checksum is switched per frame by dmfe_send_packet() */
+		iow(db, DM9KS_TCCR, 0);
+		iow(db, DM9KS_RCSR, db->rx_csum ? 0x02 : 0);	/* RX checksum enable */
 	}
+	db->tccr_on = 0;
 
 #ifdef ETRANS
 	/*If TX loading is heavy, the driver can try to anbel "early transmit".
@@ -720,18 +847,54 @@ static void dmfe_init_dm9000(struct net_device *dev)
 	iow(db, DM9KS_ETXCSR, 0x83);
 #endif
  
-	/* Set address filter table */
-	dm9000_hash_table(dev);
+	/* Set address filter table : registers were reset, write all of it */
+	db->filter_valid = 0;
+	db->rxcr = DM9KS_REG05;
+	__dm9000_hash_table(dev);
 
 	/* Activate DM9000/DM9010 */
-	iow(db, DM9KS_IMR, DM9KS_REGFF); /* Enable TX/RX interrupt mask */
-	iow(db, DM9KS_RXCR, DM9KS_REG05 | 1);	/* RX enable */
+	iow(db, DM9KS_IMR, db->imr); /* Enable TX/RX interrupt mask */
+	dmfe_write_rxcr(db, db->rxcr | 1);	/* RX enable */
 	
 	/* Init Driver variable */
 	db->tx_pkt_cnt 		= 0;
-		
-	netif_carrier_on(dev);
+	db->queue_pkt_len	= 0;
+	db->queue_pkt_csum	= 0;
+}
+
+/*
+  How many frames may sit in TX SRAM. The chip holds two: one on the
+  wire and one loaded behind it. Older revisions at 10M only take one.
+*/
+static inline int dmfe_tx_max(board_info_t *db)
+{
+#ifdef ETRANS
+	return 1;	/* early transmit starts on the SRAM write, no queueing */
+#else
+	if (db->chip_revision != 0x1A && db->Speed == 10)
+		return 1;
+	return 2;
+#endif
+}
 
+/*
+  Kick a frame already loaded into TX SRAM. Caller holds db->lock.
+  csum : the stack left the TCP/UDP checksum to us (CHECKSUM_PARTIAL);
+  TCCR only changes when two consecutive frames differ.
+*/
+static void dmfe_send_packet(board_info_t *db, u16 len, int csum)
+{
+	if (csum != db->tccr_on) {
+		iow(db, DM9KS_TCCR, csum ? 0x07 : 0);	/* TX UDP/TCP/IP checksum */
+		db->tccr_on = csum;
+	}
+	/* Set TX length to reg. 0xfc & 0xfd */
+	iow(db, DM9KS_TXPLL, (len & 0xff));
+	iow(db, DM9KS_TXPLH, (len >> 8) & 0xff);
+#ifndef ETRANS
+	/* Issue TX polling command */
+	iow(db, DM9KS_TCR, 0x1); /* Cleared after TX complete*/
+#endif
 }
 
 /*
@@ -742,74 +905,62 @@ static int dmfe_start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	board_info_t *db = (board_info_t *)dev->priv;
 	char * data_ptr;
-	int i, tmplen;
-	u16 MDWAH, MDWAL;
+	unsigned long flags;
+	u8 reg_save;
+	int csum = (skb->ip_summed == CHECKSUM_PARTIAL);
 	
 	#ifdef TDBUG /* check TX FIFO pointer */
+			u16 MDWAH, MDWAL;
 			u16 MDWAH1, MDWAL1;
 			u16 tx_ptr;
 	#endif
 	
 	DMFE_DBUG(0, "dmfe_start_xmit", 0);
-	if (db->chip_revision != 0x1A)
-	{	
-		if(db->Speed == 10)
-			{if (db->tx_pkt_cnt >= 1) return 1;}
-		else
-			{if (db->tx_pkt_cnt >= 2) return 1;}
-	}else
-		if (db->tx_pkt_cnt >= 2) return 1;
-	
-	/* packet counting */
-	db->tx_pkt_cnt++;
-
-	db->stats.tx_packets++;
-	db->stats.tx_bytes+=skb->len;
-	if (db->chip_revision != 0x1A)
-	{
-		if (db->Speed == 10)
-			{if (db->tx_pkt_cnt >= 1) netif_stop_queue(dev);}
-		else
-			{if (db->tx_pkt_cnt >= 2) netif_stop_queue(dev);}
-	}else
-		if (db->tx_pkt_cnt >= 2) netif_stop_queue(dev);		
 
-	/* Disable all interrupt */
-	iow(db, DM9KS_IMR, DM9KS_DISINTR);
+	/* the lock keeps the ISR and dmfe_poll() off the chip, no IMR toggling */
+	spin_lock_irqsave(&db->lock, flags);
+	if (db->tx_pkt_cnt >= dmfe_tx_max(db)) {
+		netif_stop_queue(dev);
+		spin_unlock_irqrestore(&db->lock, flags);
+		return 1;
+	}
+	reg_save = inb(db->io_addr);
 
+	#ifdef TDBUG /* check TX FIFO pointer */
 	MDWAH = ior(db,DM9KS_MDWAH);
 	MDWAL = ior(db,DM9KS_MDWAL);
+	#endif
 
-	/* Set TX length to reg. 0xfc & 0xfd */
-	iow(db, DM9KS_TXPLL, (skb->len & 0xff));
-	iow(db, DM9KS_TXPLH, (skb->len >> 8) & 0xff);
+#ifdef ETRANS
+	/* early transmit needs the length before the data */
+	dmfe_send_packet(db, skb->len, csum);
+#endif
 
 	/* Move data to TX SRAM */
 	data_ptr = (char *)skb->data;
 	
 	outb(DM9KS_MWCMD, db->io_addr); // Write data into SRAM trigger
-	switch(db->io_mode)
-	{
-		case DM9KS_BYTE_MODE:
-			for (i = 0; i < skb->len; i++)
-				outb((data_ptr[i] & 0xff), db->io_data);
-			break;
-		case DM9KS_WORD_MODE:
-			tmplen = (skb->len + 1) / 2;
-			for (i = 0; i < tmplen; i++)
-        outw(((u16 *)data_ptr)[i], db->io_data);
-      break;
-    case DM9KS_DWORD_MODE:
-      tmplen = (skb->len + 3) / 4;			
-			for (i = 0; i< tmplen; i++)
-				outl(((u32 *)data_ptr)[i], db->io_data);
-			break;
+	dmfe_outblk(db, data_ptr, skb->len);
+
+#ifdef ETRANS
+	db->tx_pkt_cnt++;
+#else
+	/* 
+	   Start it now if the wire is idle, otherwise leave it in SRAM
+	   for dmfe_tx_done() to kick the moment the current frame ends.
+	*/
+	if (db->tx_pkt_cnt++ == 0) {
+		dmfe_send_packet(db, skb->len, csum);
+	} else {
+		db->queue_pkt_len = skb->len;
+		db->queue_pkt_csum = csum;
 	}
-	
-#ifndef ETRANS
-	/* Issue TX polling command */
-	iow(db, DM9KS_TCR, 0x1); /* Cleared after TX complete*/
 #endif
+	if (db->tx_pkt_cnt >= dmfe_tx_max(db))
+		netif_stop_queue(dev);
+
+	db->stats.tx_packets++;
+	db->stats.tx_bytes+=skb->len;
 
 	#ifdef TDBUG /* check TX FIFO pointer */
 			MDWAH1 = ior(db,DM9KS_MDWAH);
@@ -834,14 +985,13 @@ static int dmfe_start_xmit(struct sk_buff *skb, struct net_device *dev)
 	#endif
 	/* Saved the time stamp */
 	dev->trans_start = jiffies;
-	db->cont_rx_pkt_cnt =0;
+
+	outb(reg_save, db->io_addr);
+	spin_unlock_irqrestore(&db->lock, flags);
 
 	/* Free this SKB */
 	dev_kfree_skb(skb);
 
-	/* Re-enable interrupt */
-	iow(db, DM9KS_IMR, DM9KS_REGFF);
-
 	return 0;
 }
 
@@ -854,19 +1004,26 @@ static int dmfe_stop(struct net_device *dev)
 	board_info_t *db = (board_info_t *)dev->priv;
 	DMFE_DBUG(0, "dmfe_stop", 0);
 
-	/* deleted timer */
-	del_timer(&db->timer);
-
 	netif_stop_queue(dev); 
 
 	/* free interrupt */
 	free_irq(dev->irq, dev);
 
+	/* stop the link poll and the pool refill. Only our own work items :
+	   flush_scheduled_work() would wait on linkwatch_event, which needs
+	   the RTNL we are called with. link_work goes first, it may re-arm
+	   phy_work; the refill must be gone before the pools are purged. */
+	cancel_work_sync(&db->link_work);
+	cancel_rearming_delayed_work(&db->phy_work);
+	cancel_work_sync(&db->rx_refill_work);
+	skb_queue_purge(&db->rx_pool_small);
+	skb_queue_purge(&db->rx_pool_large);
+
 	/* RESET devie */
 	phy_write(db, 0x00, 0x8000);	/* PHY RESET */
 	//iow(db, DM9KS_GPR, 0x01); 	/* Power-Down PHY */
 	iow(db, DM9KS_IMR, DM9KS_DISINTR);	/* Disable all interrupt */
-	iow(db, DM9KS_RXCR, 0x00);	/* Disable RX */
+	dmfe_write_rxcr(db, 0x00);	/* Disable RX */
 
 	/* Dump Statistic counter */
 #if FALSE
@@ -881,6 +1038,29 @@ static int dmfe_stop(struct net_device *dev)
 	return 0;
 }
 
+/* account the TSR I/II status of a completed frame */
+static void dmfe_tx_status(board_info_t *db, u8 tsr)
+{
+	if (!(tsr & 0xfc))
+		return;
+	if (tsr & 0x80) db->tx_jabber++;
+	if (tsr & 0x40) db->tx_loss_carrier++;
+	if (tsr & 0x20) db->tx_no_carrier++;
+	if (tsr & 0x10) db->tx_late_coll++;
+	if (tsr & 0x08) db->tx_coll++;
+	if (tsr & 0x04) db->tx_excess_coll++;
+
+	if (tsr & 0x08)
+		db->stats.collisions++;
+	if (tsr & 0xf4) {
+		/* frame was not delivered */
+		db->stats.tx_errors++;
+		if (tsr & 0x60) db->stats.tx_carrier_errors++;
+		if (tsr & 0x14) db->stats.tx_aborted_errors++;
+		if (tsr & 0x10) db->stats.tx_window_errors++;
+	}
+}
+
 static void dmfe_tx_done(unsigned long unused)
 {
 	struct net_device *dev = dmfe_dev;
@@ -889,24 +1069,34 @@ static void dmfe_tx_done(unsigned long unused)
 
 	DMFE_DBUG(0, "dmfe_tx_done()", 0);
 	
+	/* called from the ISR with db->lock held; TX1END/TX2END clear on read */
 	nsr = ior(db, DM9KS_NSR);
-	if (nsr & 0x0c)
+	if (!(nsr & 0x0c))
+		return;
+
+	if(nsr & 0x04) {
+		db->tx_pkt_cnt--;
+		dmfe_tx_status(db, ior(db, DM9KS_TSR1));
+	}
+	if(nsr & 0x08) {
+		db->tx_pkt_cnt--;
+		dmfe_tx_status(db, ior(db, DM9KS_TSR2));
+	}
+	if(db->tx_pkt_cnt < 0)
 	{
-		if(nsr & 0x04) db->tx_pkt_cnt--;
-		if(nsr & 0x08) db->tx_pkt_cnt--;
-		if(db->tx_pkt_cnt < 0)
-		{
-			printk(KERN_DEBUG "DM9KS:tx_pkt_cnt ERROR!!\n");
-			while(ior(db,DM9KS_TCR) & 0x1){}
-			db->tx_pkt_cnt = 0;
-		}
-			
-	}else{
-		while(ior(db,DM9KS_TCR) & 0x1){}
+		db->tx_cnt_err++;
 		db->tx_pkt_cnt = 0;
+		db->queue_pkt_len = 0;
 	}
-		
-	netif_wake_queue(dev);
+
+	/* wire is idle : send the frame already waiting in SRAM */
+	if (db->tx_pkt_cnt > 0 && db->queue_pkt_len) {
+		dmfe_send_packet(db, db->queue_pkt_len, db->queue_pkt_csum);
+		db->queue_pkt_len = 0;
+	}
+
+	if (db->tx_pkt_cnt < dmfe_tx_max(db))
+		netif_wake_queue(dev);
 	
 	return;
 }
@@ -927,7 +1117,7 @@ static void dmfe_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 {
 	struct net_device *dev = dev_id;
 	board_info_t *db;
-	int int_status,i;
+	int int_status;
 	u8 reg_save;
 
 	DMFE_DBUG(0, "dmfe_interrupt()", 0);
@@ -945,46 +1135,31 @@ static void dmfe_interrupt(int irq, void *dev_id, struct pt_regs *regs)
 	/* Got DM9000/DM9010 interrupt status */
 	int_status = ior(db, DM9KS_ISR);		/* Got ISR */
 	iow(db, DM9KS_ISR, int_status);		/* Clear ISR status */ 
+	db->irq_count++;
+	if (int_status & DM9KS_RX_INTR) db->irq_rx++;
+	if (int_status & DM9KS_TX_INTR) db->irq_tx++;
+	if (int_status & DM9KS_LINK_INTR) db->irq_link++;
 
 	/* Link status change */
 	if (int_status & DM9KS_LINK_INTR) 
+		schedule_work(&db->link_work);	/* no PHY polling in hard IRQ */
+
+	/* Received the coming packet : mask RX and leave the SRAM to dmfe_poll() */
+	if (int_status & DM9KS_RX_INTR) 
 	{
-		netif_stop_queue(dev);
-		for(i=0; i<500; i++) /*wait link OK, waiting time =0.5s */
+		if (netif_rx_schedule_prep(dev))
 		{
-			phy_read(db,0x1);
-			if(phy_read(db,0x1) & 0x4) /*Link OK*/
-			{
-				/* wait for detected Speed */
-				for(i=0; i<200;i++)
-					udelay(1000);
-				/* set media speed */
-				if(phy_read(db,0)&0x2000) db->Speed =100;
-				else db->Speed =10;
-				break;
-			}
-			udelay(1000);
+			db->imr &= ~DM9KS_RX_INTR;
+			__netif_rx_schedule(dev);
 		}
-		netif_wake_queue(dev);
-		//printk("[INTR]i=%d speed=%d\n",i, (int)(db->Speed));	
 	}
-	/* Received the coming packet */
-	if (int_status & DM9KS_RX_INTR) 
-		dmfe_packet_receive(dev);
 
 	/* Trnasmit Interrupt check */
 	if (int_status & DM9KS_TX_INTR)
 		dmfe_tx_done(0);
 	
-	if (db->cont_rx_pkt_cnt>=CONT_RX_PKT_CNT)
-	{
-		iow(db, DM9KS_IMR, 0xa2);
-	}
-	else
-	{
-		/* Re-enable interrupt mask */ 
-		iow(db, DM9KS_IMR, DM9KS_REGFF);
-	}
+	/* Re-enable interrupt mask */ 
+	iow(db, DM9KS_IMR, db->imr);
 	
 	/* Restore previous register address */
 	outb(reg_save, db->io_addr); 
@@ -1065,12 +1240,21 @@ static int dmfe_do_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 static void dmfe_timeout(struct net_device *dev)
 {
 	board_info_t *db = (board_info_t *)dev->priv;
+	unsigned long flags;
+	u8 reg_save;
 	int i;
 	
 	DMFE_DBUG(0, "dmfe_TX_timeout()", 0);
 	printk("TX time-out -- dmfe_timeout().\n");
+
+	/* the ISR's dmfe_tx_done works on the same two-slot state */
+	spin_lock_irqsave(&db->lock, flags);
+	reg_save = inb(db->io_addr);
 	db->reset_tx_timeout++;
 	db->stats.tx_errors++;
+	/* the frame parked in the second slot is never sent */
+	if (db->queue_pkt_len)
+		db->stats.tx_dropped++;
 	
 #if FALSE
 	printk("TX packet count = %d\n", db->tx_pkt_cnt);	
@@ -1089,6 +1273,7 @@ static void dmfe_timeout(struct net_device *dev)
 	if(i<100)
 	{
 			db->tx_pkt_cnt = 0;
+			db->queue_pkt_len = 0;
 			netif_wake_queue(dev);
 	}
 	else
@@ -1096,13 +1281,15 @@ static void dmfe_timeout(struct net_device *dev)
 			dmfe_reset(dev);
 	}
 
+	outb(reg_save, db->io_addr);
+	spin_unlock_irqrestore(&db->lock, flags);
 }
 
+/* called with db->lock held */
 static void dmfe_reset(struct net_device * dev)
 {
 	board_info_t *db = (board_info_t *)dev->priv;
 	u8 reg_save;
-	int i;
 	/* Save previous register address */
 	reg_save = inb(db->io_addr);
 
@@ -1110,17 +1297,11 @@ static void dmfe_reset(struct net_device * dev)
 	db->reset_counter++;
 	dmfe_init_dm9000(dev);
 	
+	/* PHY was reset too : let the state machine re-detect the link */
 	db->Speed =10;
-	for(i=0; i<1000; i++) /*wait link OK, waiting time=1 second */
-	{
-		if(phy_read(db,0x1) & 0x4) /*Link OK*/
-		{
-			if(phy_read(db,0)&0x2000) db->Speed =100;
-			else db->Speed =10;
-			break;
-		}
-		udelay(1000);
-	}
+	db->phy_state = DMFE_PHY_DOWN;
+	netif_carrier_off(dev);
+	schedule_work(&db->link_work);
 	
 	netif_wake_queue(dev);
 	
@@ -1128,37 +1309,218 @@ static void dmfe_reset(struct net_device * dev)
 	outb(reg_save, db->io_addr);
 
 }
+
 /*
-  A periodic timer routine
+  PHY state machine, run from the shared workqueue instead of
+  busy-waiting for link and auto-negotiation in IRQ/open/reset.
+  DOWN -> AN_WAIT when link appears, AN_WAIT -> UP once the speed
+  has settled, any state -> DOWN when link is lost.
 */
-static void dmfe_timer(unsigned long data)
+static void dmfe_phy_poll(struct net_device *dev)
 {
-	struct net_device * dev = (struct net_device *)data;
 	board_info_t *db = (board_info_t *)dev->priv;
-	DMFE_DBUG(0, "dmfe_timer()", 0);
-	
-	if (db->cont_rx_pkt_cnt>=CONT_RX_PKT_CNT)
-	{
-		db->cont_rx_pkt_cnt=0;
-		iow(db, DM9KS_IMR, DM9KS_REGFF);
+	unsigned long next = DMFE_PHY_POLL;
+	unsigned long flags;
+	u8 reg_save;
+	int link;
+
+	spin_lock_irqsave(&db->lock, flags);
+	reg_save = inb(db->io_addr);
+
+	phy_read(db, 0x1);			/* BMSR link bit is latched low */
+	link = phy_read(db, 0x1) & 0x4;
+
+	switch (db->phy_state) {
+	case DMFE_PHY_DOWN:
+		if (link) {
+			db->phy_state = DMFE_PHY_AN_WAIT;
+			next = DMFE_PHY_AN_DELAY;
+		}
+		break;
+	case DMFE_PHY_AN_WAIT:
+		if (!link) {
+			db->phy_state = DMFE_PHY_DOWN;
+			break;
+		}
+		/* set media speed */
+		if (phy_read(db, 0) & 0x2000) db->Speed =100;
+		else db->Speed =10;
+		db->phy_state = DMFE_PHY_UP;
+		netif_carrier_on(dev);
+		break;
+	case DMFE_PHY_UP:
+		if (!link) {
+			db->phy_state = DMFE_PHY_DOWN;
+			netif_carrier_off(dev);
+		}
+		break;
 	}
-	/* Set timer again */
-	db->timer.expires = DMFE_TIMER_WUT;
-	add_timer(&db->timer);
-	
-	return;
+
+	outb(reg_save, db->io_addr);
+	spin_unlock_irqrestore(&db->lock, flags);
+
+	if (netif_running(dev))
+		schedule_delayed_work(&db->phy_work, next);
+}
+
+static void dmfe_phy_work(struct work_struct *work)
+{
+	board_info_t *db = container_of(work, board_info_t, phy_work.work);
+
+	dmfe_phy_poll(db->mii.dev);
+}
+
+/* link change interrupt : re-evaluate now instead of at the next tick */
+static void dmfe_link_work(struct work_struct *work)
+{
+	board_info_t *db = container_of(work, board_info_t, link_work);
+
+	cancel_delayed_work(&db->phy_work);
+	dmfe_phy_poll(db->mii.dev);
+}
+
+/*
+  NAPI poll routine : drain the RX SRAM in softirq context, at most
+  quota frames per call. RX interrupt stays masked until SRAM is empty.
+*/
+static int dmfe_poll(struct net_device *dev, int *budget)
+{
+	board_info_t *db = (board_info_t *)dev->priv;
+	int quota = min(dev->quota, *budget);
+	struct sk_buff *skb;
+	unsigned long flags;
+	int work_done = 0;
+	int more = 1;
+	u8 reg_save;
+
+	DMFE_DBUG(0, "dmfe_poll()", 0);
+	db->poll_count++;
+
+	while (work_done < quota) {
+		/* The chip is only locked for the copy of one frame */
+		spin_lock_irqsave(&db->lock, flags);
+		reg_save = inb(db->io_addr);
+		more = dmfe_packet_receive(dev, &skb);
+		outb(reg_save, db->io_addr);
+		spin_unlock_irqrestore(&db->lock, flags);
+
+		if (!more)
+			break;
+
+		/* dropped frames count too, so an error storm is bounded */
+		work_done++;
+		if (skb)
+			netif_receive_skb(skb);
+	}
+
+	dev->quota -= work_done;
+	*budget -= work_done;
+
+	if (more)
+		return 1;
+
+	/*
+	  SRAM empty : leave polling mode and unmask RX interrupt. Check the
+	  SRAM once more in the same lock hold : the ISR acks PR even while RX
+	  is masked, so a frame that landed since the last look may have no
+	  interrupt left to announce it.
+	*/
+	spin_lock_irqsave(&db->lock, flags);
+	reg_save = inb(db->io_addr);
+	ior(db, DM9KS_MRCMDX);		/* Dummy read */
+	if (inb(db->io_data) & 0x3) {	/* frame ready or RX byte error */
+		outb(reg_save, db->io_addr);
+		spin_unlock_irqrestore(&db->lock, flags);
+		return 1;
+	}
+	netif_rx_complete(dev);
+	db->poll_complete++;
+	db->imr |= DM9KS_RX_INTR;
+	iow(db, DM9KS_IMR, db->imr);
+	outb(reg_save, db->io_addr);
+	spin_unlock_irqrestore(&db->lock, flags);
+
+	return 0;
 }
 
+/*
+  Fill both RX pools up to their depth. Runs in process context,
+  from dmfe_open() and from rx_refill_work.
+*/
+static void dmfe_rx_refill(board_info_t *db)
+{
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&db->rx_pool_small) < DMFE_POOL_SMALL) {
+		skb = __dev_alloc_skb(DMFE_RXBUF_SMALL, GFP_KERNEL);
+		if (!skb)
+			return;
+		skb_queue_tail(&db->rx_pool_small, skb);
+	}
+	while (skb_queue_len(&db->rx_pool_large) < DMFE_POOL_LARGE) {
+		skb = __dev_alloc_skb(DMFE_RXBUF_LARGE, GFP_KERNEL);
+		if (!skb)
+			return;
+		skb_queue_tail(&db->rx_pool_large, skb);
+	}
+}
+
+static void dmfe_rx_refill_work(struct work_struct *work)
+{
+	board_info_t *db = container_of(work, board_info_t, rx_refill_work);
+
+	dmfe_rx_refill(db);
+}
+
+/*
+  Get an skb for a len byte frame (CRC included) : small frames go to
+  the small pool (copybreak), the rest to the large one. Falls back to
+  dev_alloc_skb() when the pool is empty and asks for a refill once a
+  pool drops below half.
+*/
+static struct sk_buff *dmfe_rx_get_skb(board_info_t *db, int len)
+{
+	struct sk_buff_head *pool;
+	struct sk_buff *skb;
+	int depth;
+
+	if (len <= DMFE_COPYBREAK + 4) {
+		pool = &db->rx_pool_small;
+		depth = DMFE_POOL_SMALL;
+		db->rx_copybreak++;
+	} else {
+		pool = &db->rx_pool_large;
+		depth = DMFE_POOL_LARGE;
+	}
+
+	skb = skb_dequeue(pool);
+	if (skb) {
+		db->rx_pool_hit++;
+	} else {
+		db->rx_pool_miss++;
+		skb = dev_alloc_skb(len + 4);
+		if (!skb)
+			db->rx_pool_drop++;
+	}
+
+	if (skb_queue_len(pool) < depth / 2)
+		schedule_work(&db->rx_refill_work);
+
+	return skb;
+}
 
 /*
   Received a packet and pass to upper layer
+  Pull one frame out of the RX SRAM, called with db->lock held.
+  Return 0 when there is nothing more to receive, 1 when a frame was
+  consumed : *pskb is the frame, or NULL if it was dropped.
 */
-static void dmfe_packet_receive(struct net_device *dev)
+static int dmfe_packet_receive(struct net_device *dev, struct sk_buff **pskb)
 {
 	board_info_t *db = (board_info_t *)dev->priv;
 	struct sk_buff *skb;
 	u8 rxbyte;
-	u16 i, GoodPacket, tmplen = 0, MDRAH, MDRAL;
+	u16 GoodPacket, MDRAH, MDRAL;
 	u32 tmpdata;
 
 	rx_t rx;
@@ -1168,192 +1530,165 @@ static void dmfe_packet_receive(struct net_device *dev)
 
 	DMFE_DBUG(0, "dmfe_packet_receive()", 0);
 
-	db->cont_rx_pkt_cnt=0;
+	*pskb = NULL;
+
+	/*store the value of Memory Data Read address register*/
+	MDRAH=ior(db, DM9KS_MDRAH);
+	MDRAL=ior(db, DM9KS_MDRAL);
 	
-	do {
-		/*store the value of Memory Data Read address register*/
-		MDRAH=ior(db, DM9KS_MDRAH);
-		MDRAL=ior(db, DM9KS_MDRAL);
-		
-		ior(db, DM9KS_MRCMDX);		/* Dummy read */
-		rxbyte = inb(db->io_data);	/* Got most updated data */
-
-#ifdef CHECKSUM	
-		if (rxbyte&0x2)			/* check RX byte */
-		{	
-      printk("dm9ks: abnormal!\n");
-			dmfe_reset(dev); 
-			break;	
-    }else { 
-      if (!(rxbyte&0x1))
-				break;	
-    }		
-#else
-		if (rxbyte==0)
-			break;
-		
-		if (rxbyte>1)
-		{	
-      printk("dm9ks: Rxbyte error!\n");
-		  dmfe_reset(dev);
-      break;	
-    }
-#endif
+	ior(db, DM9KS_MRCMDX);		/* Dummy read */
+	rxbyte = inb(db->io_data);	/* Got most updated data */
 
-		/* A packet ready now  & Get status/length */
-		GoodPacket = TRUE;
-		outb(DM9KS_MRCMD, db->io_addr);
+	/*
+	  bit0 ready, bit1 error. With RCSR.RCSEN the upper bits carry the
+	  checksum status, so only these two are checked in either mode.
+	*/
+	if (rxbyte&0x2)			/* check RX byte */
+	{	
+		db->rx_ready_err++;
+		if (net_ratelimit())
+			printk(KERN_WARNING "dm9ks: Rxbyte error!\n");
+		dmfe_reset(dev); 
+		return 0;
+	}
+	if (!(rxbyte&0x1))
+		return 0;
 
-		/* Read packet status & length */
-		switch (db->io_mode) 
-			{
-			  case DM9KS_BYTE_MODE: 
- 				    *ptr = inb(db->io_data) + 
-				               (inb(db->io_data) << 8);
-				    *(ptr+1) = inb(db->io_data) + 
-					    (inb(db->io_data) << 8);
-				    break;
-			  case DM9KS_WORD_MODE:
-				    *ptr = inw(db->io_data);
-				    *(ptr+1)    = inw(db->io_data);
-				    break;
-			  case DM9KS_DWORD_MODE:
-				    tmpdata  = inl(db->io_data);
-				    *ptr = tmpdata;
-				    *(ptr+1)    = tmpdata >> 16;
-				    break;
-			  default:
-				    break;
-			}
+	/* A packet ready now  & Get status/length */
+	GoodPacket = TRUE;
+	outb(DM9KS_MRCMD, db->io_addr);
 
-		/* Packet status check */
-		if (rx.desc.status & 0xbf)
+	/* Read packet status & length */
+	switch (db->io_mode) 
 		{
-			GoodPacket = FALSE;
-			if (rx.desc.status & 0x01) 
-			{
-				db->stats.rx_fifo_errors++;
-				printk(KERN_INFO"<RX FIFO error>\n");
-			}
-			if (rx.desc.status & 0x02) 
-			{
-				db->stats.rx_crc_errors++;
-				printk(KERN_INFO"<RX CRC error>\n");
-			}
-			if (rx.desc.status & 0x80) 
-			{
-				db->stats.rx_length_errors++;
-				printk(KERN_INFO"<RX Length error>\n");
-			}
-			if (rx.desc.status & 0x08)
-				printk(KERN_INFO"<Physical Layer error>\n");
+		  case DM9KS_BYTE_MODE: 
+			    *ptr = inb(db->io_data) + 
+			               (inb(db->io_data) << 8);
+			    *(ptr+1) = inb(db->io_data) + 
+				    (inb(db->io_data) << 8);
+			    break;
+		  case DM9KS_WORD_MODE:
+			    *ptr = inw(db->io_data);
+			    *(ptr+1)    = inw(db->io_data);
+			    break;
+		  case DM9KS_DWORD_MODE:
+			    tmpdata  = inl(db->io_data);
+			    *ptr = tmpdata;
+			    *(ptr+1)    = tmpdata >> 16;
+			    break;
+		  default:
+			    break;
 		}
 
-		if (!GoodPacket)
+	/* Packet status check : count per cause, no printk on the data path */
+	if (rx.desc.status & 0xbf)
+	{
+		GoodPacket = FALSE;
+		db->stats.rx_errors++;
+		if (rx.desc.status & 0x01) 
 		{
-			// drop this packet!!!
-			switch (db->io_mode)
-			{
-				case DM9KS_BYTE_MODE:
-			 		for (i=0; i<rx.desc.length; i++)
-						inb(db->io_data);
-					break;
-				case DM9KS_WORD_MODE:
-					tmplen = (rx.desc.length + 1) / 2;
-					for (i = 0; i < tmplen; i++)
-						inw(db->io_data);
-					break;
-				case DM9KS_DWORD_MODE:
-					tmplen = (rx.desc.length + 3) / 4;
-					for (i = 0; i < tmplen; i++)
-						inl(db->io_data);
-					break;
-			}
-			continue;/*next the packet*/
+			db->stats.rx_fifo_errors++;
+			db->rx_fifo_err++;
 		}
-		
-		skb = dev_alloc_skb(rx.desc.length+4);
-		if (skb == NULL )
-		{	
-			printk(KERN_INFO "%s: Memory squeeze.\n", dev->name);
-			/*re-load the value into Memory data read address register*/
-			iow(db,DM9KS_MDRAH,MDRAH);
-			iow(db,DM9KS_MDRAL,MDRAL);
-			return;
+		if (rx.desc.status & 0x02) 
+		{
+			db->stats.rx_crc_errors++;
+			db->rx_crc_err++;
 		}
-		else
+		if (rx.desc.status & 0x04) 
 		{
-			/* Move data from DM9000 */
-			skb->dev = dev;
-			skb_reserve(skb, 2);
-			rdptr = (u8*)skb_put(skb, rx.desc.length - 4);
-			
-			/* Read received packet from RX SARM */
-			switch (db->io_mode)
-			{
-				case DM9KS_BYTE_MODE:
-			 		for (i=0; i<rx.desc.length; i++)
-						rdptr[i]=inb(db->io_data);
-					break;
-				case DM9KS_WORD_MODE:
-					tmplen = (rx.desc.length + 1) / 2;
-					for (i = 0; i < tmplen; i++)
-						((u16 *)rdptr)[i] = inw(db->io_data);
-					break;
-				case DM9KS_DWORD_MODE:
-					tmplen = (rx.desc.length + 3) / 4;
-					for (i = 0; i < tmplen; i++)
-						((u32 *)rdptr)[i] = inl(db->io_data);
-					break;
-			}
-		
-			/* Pass to upper layer */
-			skb->protocol = eth_type_trans(skb,dev);
+			db->stats.rx_frame_errors++;
+			db->rx_align_err++;
+		}
+		if (rx.desc.status & 0x08)
+			db->rx_phy_err++;
+		if (rx.desc.status & 0x10)
+			db->rx_wdt_err++;
+		if (rx.desc.status & 0x20)
+			db->rx_late_coll++;
+		if (rx.desc.status & 0x80) 
+		{
+			db->stats.rx_length_errors++;
+			db->rx_runt++;
+		}
+	}
 
-#ifdef CHECKSUM
-		if((rxbyte&0xe0)==0)	/* receive packet no checksum fail */
-				skb->ip_summed = CHECKSUM_UNNECESSARY;
-#endif
-		
-			netif_rx(skb);
-			dev->last_rx=jiffies;
-			db->stats.rx_packets++;
-			db->stats.rx_bytes += rx.desc.length;
-			db->cont_rx_pkt_cnt++;
+	/* Length includes CRC : the pool buffers hold 1536 + 4 bytes at most */
+	if (GoodPacket &&
+	    (rx.desc.length < 0x40 || rx.desc.length > 1536 + 4))
+	{
+		GoodPacket = FALSE;
+		db->stats.rx_errors++;
+		db->stats.rx_length_errors++;
+	}
+
+	if (!GoodPacket)
+	{
+		// drop this packet!!!
+		dmfe_dumpblk(db, rx.desc.length);
+		return 1;/*next the packet*/
+	}
+	
+	skb = dmfe_rx_get_skb(db, rx.desc.length);
+	if (skb == NULL )
+	{	
+		/* drop it rather than stall the SRAM until memory comes back */
+		db->stats.rx_dropped++;
+		dmfe_dumpblk(db, rx.desc.length);
+		return 1;
+	}
+
+	/* Move data from DM9000 */
+	skb->dev = dev;
+	skb_reserve(skb, 2);
+	rdptr = (u8*)skb_put(skb, rx.desc.length - 4);
+	
+	/* Read received packet from RX SARM */
+	dmfe_inblk(db, rdptr, rx.desc.length);
+
+	/* Pass to upper layer */
+	skb->protocol = eth_type_trans(skb,dev);
+
+	/*
+	  rxbyte[4:2] UDP/TCP/IP packet, rxbyte[7:5] UDP/TCP/IP checksum fail.
+	  Only TCP/UDP may skip the stack check : CHECKSUM_UNNECESSARY
+	  would also let ICMP & co through unverified.
+	*/
+	if (db->rx_csum && (rxbyte & 0x18) && !(rxbyte & 0xe0))
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	dev->last_rx=jiffies;
+	db->stats.rx_packets++;
+	db->stats.rx_bytes += rx.desc.length;
 #ifdef RDBG /* check RX FIFO pointer */
-			u16 MDRAH1, MDRAL1;
-			u16 tmp_ptr;
-			MDRAH1 = ior(db,DM9KS_MDRAH);
-			MDRAL1 = ior(db,DM9KS_MDRAL);
-			tmp_ptr = (MDRAH<<8)|MDRAL;
-			switch (db->io_mode)
-			{
-				case DM9KS_BYTE_MODE:
-					tmp_ptr += rx.desc.length+4;
-					break;
-				case DM9KS_WORD_MODE:
-					tmp_ptr += ((rx.desc.length+1)/2)*2+4;
-					break;
-				case DM9KS_DWORD_MODE:
-					tmp_ptr += ((rx.desc.length+3)/4)*4+4;
-					break;
-			}
-			if (tmp_ptr >=0x4000)
-				tmp_ptr = (tmp_ptr - 0x4000) + 0xc00;
-			if (tmp_ptr != ((MDRAH1<<8)|MDRAL1))
-				printk("[dm9ks:RX FIFO ERROR\n");
-#endif
-				
-			if (db->cont_rx_pkt_cnt>=CONT_RX_PKT_CNT)
-			{
-				dmfe_tx_done(0);
+	{
+		u16 MDRAH1, MDRAL1;
+		u16 tmp_ptr;
+		MDRAH1 = ior(db,DM9KS_MDRAH);
+		MDRAL1 = ior(db,DM9KS_MDRAL);
+		tmp_ptr = (MDRAH<<8)|MDRAL;
+		switch (db->io_mode)
+		{
+			case DM9KS_BYTE_MODE:
+				tmp_ptr += rx.desc.length+4;
+				break;
+			case DM9KS_WORD_MODE:
+				tmp_ptr += ((rx.desc.length+1)/2)*2+4;
+				break;
+			case DM9KS_DWORD_MODE:
+				tmp_ptr += ((rx.desc.length+3)/4)*4+4;
 				break;
-			}
 		}
-			
-	}while((rxbyte & 0x01) == DM9KS_PKT_RDY);
+		if (tmp_ptr >=0x4000)
+			tmp_ptr = (tmp_ptr - 0x4000) + 0xc00;
+		if (tmp_ptr != ((MDRAH1<<8)|MDRAL1))
+			printk("[dm9ks:RX FIFO ERROR\n");
+	}
+#endif
+
+	*pskb = skb;
 	DMFE_DBUG(0, "[END]dmfe_packet_receive()", 0);
-	
+	return 1;
 }
 
 /*
@@ -1368,75 +1703,117 @@ static u16 read_srom_word(board_info_t *db, int offset)
 	return (ior(db, DM9KS_EPDRL) + (ior(db, DM9KS_EPDRH) << 8) );
 }
 
+/*
+  CRC32 (ether_crc_le) of a 6 byte MAC address for the 64-bit hash :
+  slice-by-4 over the first 4 bytes, then bytewise. Tables are built
+  once at module init.
+*/
+static u32 dmfe_crc_table[4][256];
+
+static void dmfe_crc_init(void)
+{
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+		dmfe_crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 4; j++)
+			dmfe_crc_table[j][i] = (dmfe_crc_table[j - 1][i] >> 8) ^
+				dmfe_crc_table[0][dmfe_crc_table[j - 1][i] & 0xff];
+}
+
+static u32 dmfe_crc_addr(const u8 *addr)
+{
+	u32 crc = ~0;
+
+	crc ^= addr[0] | (addr[1] << 8) | (addr[2] << 16) | (addr[3] << 24);
+	crc = dmfe_crc_table[3][crc & 0xff] ^
+	      dmfe_crc_table[2][(crc >> 8) & 0xff] ^
+	      dmfe_crc_table[1][(crc >> 16) & 0xff] ^
+	      dmfe_crc_table[0][crc >> 24];
+	crc = (crc >> 8) ^ dmfe_crc_table[0][(crc ^ addr[4]) & 0xff];
+	crc = (crc >> 8) ^ dmfe_crc_table[0][(crc ^ addr[5]) & 0xff];
+	return crc;
+}
+
+/* RXCR through the cache; db->lock held or chip idle */
+static void dmfe_write_rxcr(board_info_t *db, u8 rxcr)
+{
+	if (db->filter_valid && rxcr == db->rxcr)
+		return;
+	iow(db, DM9KS_RXCR, rxcr);
+	db->rxcr = rxcr;
+}
+
 /*
   Set DM9000/DM9010 multicast address
+  Caller holds db->lock (or the chip is not running yet). Only the PAR,
+  MAR and RXCR bytes that differ from the last programmed value are
+  written, unless filter_valid was cleared by dmfe_init_dm9000().
 */
-static void dm9000_hash_table(struct net_device *dev)
+static void __dm9000_hash_table(struct net_device *dev)
 {
 	board_info_t *db = (board_info_t *)dev->priv;
 	struct dev_mc_list *mcptr = dev->mc_list;
 	int mc_cnt = dev->mc_count;
 	u32 hash_val;
-	u16 i, oft, hash_table[4];
+	u8 rxcr, mar[8];
+	int i;
 
 	DMFE_DBUG(0, "dm9000_hash_table()", 0);
 
-	/* enable promiscuous mode */
-	if (dev->flags & IFF_PROMISC){
-		//printk(KERN_INFO "DM9KS:enable promiscuous mode\n");
-		iow(db, DM9KS_RXCR, ior(db,DM9KS_RXCR)|(1<<1));
-		return;
-	}else{
-		//printk(KERN_INFO "DM9KS:disable promiscuous mode\n");
-		iow(db, DM9KS_RXCR, ior(db,DM9KS_RXCR)&(~(1<<1)));
-	}
-		
-	/* Receive all multicast packets */
-	if (dev->flags & IFF_ALLMULTI){
-		//printk(KERN_INFO "DM9KS:Pass all multicast\n");
-		iow(db, DM9KS_RXCR, ior(db,DM9KS_RXCR)|(1<<3));
-	}else{
-		//printk(KERN_INFO "DM9KS:Disable pass all multicast\n");
-		iow(db, DM9KS_RXCR, ior(db,DM9KS_RXCR)&(~(1<<3)));
-	}
-	
-	/* Set Node address */
-	for (i = 0, oft = 0x10; i < 6; i++, oft++)
-		iow(db, oft, dev->dev_addr[i]);
-
-	/* Clear Hash Table */
-	for (i = 0; i < 4; i++)
-		hash_table[i] = 0x0;
-
-	/* broadcast address */
-	hash_table[3] = 0x8000;
+	/* promiscuous mode / receive all multicast packets, RX enable kept */
+	rxcr = db->rxcr & ~((1<<1) | (1<<3));
+	if (dev->flags & IFF_PROMISC)
+		rxcr |= (1<<1);
+	if (dev->flags & IFF_ALLMULTI)
+		rxcr |= (1<<3);
 
-	/* the multicast address in Hash Table : 64 bits */
+	/* broadcast address + the multicast addresses : 64 bits */
+	memset(mar, 0, sizeof(mar));
+	mar[7] = 0x80;
 	for (i = 0; i < mc_cnt; i++, mcptr = mcptr->next) {
-		hash_val = cal_CRC((char *)mcptr->dmi_addr, 6, 0) & 0x3f; 
-		hash_table[hash_val / 16] |= (u16) 1 << (hash_val % 16);
+		hash_val = dmfe_crc_addr(mcptr->dmi_addr) & 0x3f; 
+		mar[hash_val / 8] |= 1 << (hash_val % 8);
+	}
+
+	/* Set Node address */
+	for (i = 0; i < 6; i++) {
+		if (!db->filter_valid || db->par[i] != dev->dev_addr[i]) {
+			iow(db, 0x10 + i, dev->dev_addr[i]);
+			db->par[i] = dev->dev_addr[i];
+		}
 	}
 
 	/* Write the hash table to MAC MD table */
-	for (i = 0, oft = 0x16; i < 4; i++) {
-		iow(db, oft++, hash_table[i] & 0xff);
-		iow(db, oft++, (hash_table[i] >> 8) & 0xff);
+	for (i = 0; i < 8; i++) {
+		if (!db->filter_valid || db->mar[i] != mar[i]) {
+			iow(db, 0x16 + i, mar[i]);
+			db->mar[i] = mar[i];
+		}
 	}
+
+	dmfe_write_rxcr(db, rxcr);
+	db->filter_valid = 1;
 }
 
-/*
-  Calculate the CRC valude of the Rx packet
-  flag = 1 : return the reverse CRC (for the received packet CRC)
-         0 : return the normal CRC (for Hash Table index)
-*/
-static unsigned long cal_CRC(unsigned char * Data, unsigned int Len, u8 flag)
-{	
-	u32 crc = ether_crc_le(Len, Data);
+/* set_multicast_list entry : may run while the ISR or dmfe_poll() is active */
+static void dm9000_hash_table(struct net_device *dev)
+{
+	board_info_t *db = (board_info_t *)dev->priv;
+	unsigned long flags;
+	u8 reg_save;
 
-	if (flag) 
-		return ~crc;
-		
-	return crc;	 
+	spin_lock_irqsave(&db->lock, flags);
+	reg_save = inb(db->io_addr);
+	__dm9000_hash_table(dev);
+	outb(reg_save, db->io_addr);
+	spin_unlock_irqrestore(&db->lock, flags);
 }
 
 static int mdio_read(struct net_device *dev, int phy_id, int location)
@@ -1559,40 +1936,107 @@ static uint32_t dmfe_get_rx_csum(struct net_device *dev)
 */
 static uint32_t dmfe_get_tx_csum(struct net_device *dev)
 {
-	return (dev->features & NETIF_F_HW_CSUM) != 0;
+	return (dev->features & NETIF_F_IP_CSUM) != 0;
 }
 /* 
 * Enable/Disable RX checksum offload
 */
 static int dmfe_set_rx_csum(struct net_device *dev, uint32_t data)
 {
-#ifdef CHECKSUM
 	board_info_t *db = (board_info_t *)dev->priv;
-	db->rx_csum = data;
+	unsigned long flags;
+	u8 reg_save;
 
-	if(netif_running(dev)) {
-		dmfe_stop(dev);
-		dmfe_open(dev);
-	} else
-		dmfe_init_dm9000(dev);
-#else
-	printk(KERN_ERR "DM9:Don't support checksum\n");
-#endif
+	if (!db->csum_hw)
+		return data ? -EOPNOTSUPP : 0;
+
+	/* no restart needed : RCSR takes effect from the next frame */
+	spin_lock_irqsave(&db->lock, flags);
+	reg_save = inb(db->io_addr);
+	db->rx_csum = data ? 1 : 0;
+	iow(db, DM9KS_RCSR, db->rx_csum ? 0x02 : 0);
+	outb(reg_save, db->io_addr);
+	spin_unlock_irqrestore(&db->lock, flags);
 	return 0;
 }
 /* 
 * Enable/Disable TX checksum offload
 */
+#define DMFE_STAT(m)	{ #m, offsetof(board_info_t, m) }
+
+static const struct {
+	char name[ETH_GSTRING_LEN];
+	int offset;	/* of a u32 in board_info_t */
+} dmfe_gstrings_stats[] = {
+	DMFE_STAT(rx_pool_hit),
+	DMFE_STAT(rx_pool_miss),
+	DMFE_STAT(rx_copybreak),
+	DMFE_STAT(rx_pool_drop),
+	DMFE_STAT(rx_fifo_err),
+	DMFE_STAT(rx_crc_err),
+	DMFE_STAT(rx_align_err),
+	DMFE_STAT(rx_phy_err),
+	DMFE_STAT(rx_wdt_err),
+	DMFE_STAT(rx_late_coll),
+	DMFE_STAT(rx_runt),
+	DMFE_STAT(rx_ready_err),
+	DMFE_STAT(tx_jabber),
+	DMFE_STAT(tx_loss_carrier),
+	DMFE_STAT(tx_no_carrier),
+	DMFE_STAT(tx_late_coll),
+	DMFE_STAT(tx_coll),
+	DMFE_STAT(tx_excess_coll),
+	DMFE_STAT(tx_cnt_err),
+	DMFE_STAT(reset_counter),
+	DMFE_STAT(reset_tx_timeout),
+	DMFE_STAT(irq_count),
+	DMFE_STAT(irq_rx),
+	DMFE_STAT(irq_tx),
+	DMFE_STAT(irq_link),
+	DMFE_STAT(poll_count),
+	DMFE_STAT(poll_complete),
+};
+
+#define DMFE_STATS_LEN	ARRAY_SIZE(dmfe_gstrings_stats)
+
+static int dmfe_get_stats_count(struct net_device *dev)
+{
+	return DMFE_STATS_LEN;
+}
+
+static void dmfe_get_strings(struct net_device *dev, u32 stringset, u8 *data)
+{
+	int i;
+
+	if (stringset != ETH_SS_STATS)
+		return;
+	for (i = 0; i < DMFE_STATS_LEN; i++)
+		memcpy(data + i * ETH_GSTRING_LEN,
+		       dmfe_gstrings_stats[i].name, ETH_GSTRING_LEN);
+}
+
+static void dmfe_get_ethtool_stats(struct net_device *dev,
+				   struct ethtool_stats *stats, u64 *data)
+{
+	board_info_t *db = (board_info_t *)dev->priv;
+	int i;
+
+	for (i = 0; i < DMFE_STATS_LEN; i++)
+		data[i] = *(u32 *)((char *)db + dmfe_gstrings_stats[i].offset);
+}
+
 static int dmfe_set_tx_csum(struct net_device *dev, uint32_t data)
 {
-#ifdef CHECKSUM
+	board_info_t *db = (board_info_t *)dev->priv;
+
+	if (!db->csum_hw)
+		return data ? -EOPNOTSUPP : 0;
+
+	/* TCCR follows skb->ip_summed per frame, see dmfe_send_packet() */
 	if (data)
-		dev->features |= NETIF_F_HW_CSUM;
+		dev->features |= NETIF_F_IP_CSUM;
 	else
-		dev->features &= ~NETIF_F_HW_CSUM;
-#else
-	printk(KERN_ERR "DM9:Don't support checksum\n");
-#endif
+		dev->features &= ~NETIF_F_IP_CSUM;
 
 	return 0;
 }
@@ -1608,6 +2052,9 @@ static struct ethtool_ops dmfe_ethtool_ops = {
 	.set_rx_csum		= dmfe_set_rx_csum,
 	.get_tx_csum		= dmfe_get_tx_csum,
 	.set_tx_csum		= dmfe_set_tx_csum,
+	.get_stats_count	= dmfe_get_stats_count,
+	.get_strings		= dmfe_get_strings,
+	.get_ethtool_stats	= dmfe_get_ethtool_stats,
 };
 #endif
 
@@ -1634,6 +2081,14 @@ MODULE_PARM_DESC(iobase, "EtherLink I/O base address");
 */
 int __init dm9000c_init(void)
 {
+#ifdef DM9KS_EMU
+	int err;
+
+	err = dm9emu_init();
+	if (err)
+		return err;
+	iobase = DM9EMU_BASE;
+#else
 	volatile unsigned long *bwscon;
 	volatile unsigned long *bankcon4;
 	unsigned long val;
@@ -1662,7 +2117,10 @@ int __init dm9000c_init(void)
 
 	 iounmap(bwscon);
 	 iounmap(bankcon4);
+#endif
 	 
+	dmfe_crc_init();
+
 	switch(mode) {
 		case DM9KS_10MHD:
 		case DM9KS_100MHD:
@@ -1674,8 +2132,12 @@ int __init dm9000c_init(void)
 			media_mode = DM9KS_AUTO;
 	}
 	dmfe_dev = dmfe_probe();
-	if(IS_ERR(dmfe_dev))
+	if(IS_ERR(dmfe_dev)) {
+#ifdef DM9KS_EMU
+		dm9emu_exit();
+#endif
 		return PTR_ERR(dmfe_dev);
+	}
 	return 0;
 }
 /* Description: 
@@ -1694,7 +2156,11 @@ void __exit dm9000c_exit(void)
 #else
 	free_netdev(dev);
 #endif
+#ifdef DM9KS_EMU
+	dm9emu_exit();
+#else
 	iounmap((void * )iobase);
+#endif
 	DMFE_DBUG(0, "clean_module() exit", 0);
 }
 
@@ -0,0 +1,663 @@
+/*
+  dm9000c_emu.c: software model of the DM9000 register file and SRAM
+
+  Lets dm9000c_drv.c run, be regression tested and be benchmarked on a
+  box without the chip (e.g. an x86 CI machine running 2.6.22):
+
+	make EMU=1 KERN_DIR=<kernel tree>
+	insmod dm9ks_emu.ko [loopback=1] [iomode=0]
+
+  What is modelled:
+   - index/data port pair at DM9EMU_BASE, DM9EMU_BASE+4
+   - register file incl. NSR/ISR/IMR semantics, VID/PID/CHIPR
+   - EEPROM (a DM9000 ID and a 00:60:6E MAC) and PHY behind EPCR/EPAR
+   - TX SRAM 0x0000-0x0BFF written through MWCMD, two TX requests may
+     be outstanding like on the chip (TX1END/TX2END)
+   - RX ring 0x0C00-0x3FFF read through MRCMDX/MRCMD, frames laid out
+     as the chip does : 01h, RSR, length (incl. CRC), data, CRC
+   - interrupt line : a tasklet calls the driver handler whenever
+     ISR & IMR is non zero
+
+  Frame sources:
+   - loopback=1 (default) : every transmitted frame is put back into
+     the RX ring, bypassing the address filter (MAC internal loopback)
+   - /proc/dm9emu : each write() is injected as one received frame,
+     subject to the PAR/MAR/RXCR address filter. dm9emu_pcap feeds a
+     pcap file through it. Reading it shows the model counters.
+   - /proc/dm9emu_link : write 0 or 1 to drop or raise the PHY link
+*/
+#define DM9EMU_IMPL
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/interrupt.h>
+#include <linux/proc_fs.h>
+#include <linux/crc32.h>
+#include <linux/if_ether.h>
+#include <asm/uaccess.h>
+
+#include "dm9000c_emu.h"
+
+#define EMU_TX_END		0x0c00	/* TX SRAM 0x0000-0x0bff */
+#define EMU_RX_START		0x0c00	/* RX ring 0x0c00-0x3fff */
+#define EMU_RX_END		0x4000
+#define EMU_RX_SIZE		(EMU_RX_END - EMU_RX_START)
+
+/* registers with side effects */
+#define EMU_NCR			0x00
+#define EMU_NSR			0x01
+#define EMU_TCR			0x02
+#define EMU_TSR1		0x03
+#define EMU_TSR2		0x04
+#define EMU_RXCR		0x05
+#define EMU_EPCR		0x0b
+#define EMU_EPAR		0x0c
+#define EMU_EPDRL		0x0d
+#define EMU_EPDRH		0x0e
+#define EMU_PAR			0x10
+#define EMU_MAR			0x16
+#define EMU_VIDL		0x28
+#define EMU_CHIPR		0x2c
+#define EMU_MRCMDX		0xf0
+#define EMU_MRCMD		0xf2
+#define EMU_MDRAL		0xf4
+#define EMU_MDRAH		0xf5
+#define EMU_MWCMD		0xf8
+#define EMU_MDWAL		0xfa
+#define EMU_MDWAH		0xfb
+#define EMU_TXPLL		0xfc
+#define EMU_TXPLH		0xfd
+#define EMU_ISR			0xfe
+#define EMU_IMR			0xff
+
+static int loopback = 1;
+static int iomode;		/* ISR[7:6] : 0 word, 1 dword, 2 byte */
+module_param(loopback, int, 0);
+module_param(iomode, int, 0);
+MODULE_PARM_DESC(loopback, "put transmitted frames back into the RX ring");
+MODULE_PARM_DESC(iomode, "bus width reported to the driver: 0 word, 1 dword, 2 byte");
+
+static struct dm9emu {
+	spinlock_t lock;
+	u8 index;			/* last value written to the index port */
+	u8 regs[256];
+	u16 phy[32];
+	u16 srom[64];
+	u8 sram[EMU_RX_END];
+
+	u16 tx_rd;			/* start of the next frame to send */
+	u16 tx_len[2];			/* lengths latched by TCR.TXREQ */
+	int tx_cnt;			/* outstanding TX requests */
+	int tx_slot;			/* 0 : next completion is TX1END */
+	u16 rx_wr;			/* RX ring write pointer */
+	int link;
+
+	irq_handler_t handler;
+	void *dev_id;
+	unsigned int irq;
+	struct tasklet_struct tasklet;
+
+	u32 tx_frames;
+	u32 rx_frames;
+	u32 rx_overflow;		/* no room in the RX ring */
+	u32 rx_filtered;		/* rejected by the address filter */
+	u32 rx_disabled;		/* arrived while RXCR.RXEN was clear */
+	u32 irqs;
+} emu;
+
+static u8 emu_frame[EMU_TX_END];
+
+static inline u16 emu_get16(int reg)
+{
+	return emu.regs[reg] | (emu.regs[reg + 1] << 8);
+}
+
+static inline void emu_set16(int reg, u16 value)
+{
+	emu.regs[reg] = value & 0xff;
+	emu.regs[reg + 1] = value >> 8;
+}
+
+static inline int emu_width(void)
+{
+	switch (iomode) {
+	case 1:  return 4;
+	case 2:  return 1;
+	default: return 2;
+	}
+}
+
+/* interrupt line follows ISR & IMR; called with emu.lock held */
+static void emu_update_irq(void)
+{
+	if (emu.handler && (emu.regs[EMU_ISR] & emu.regs[EMU_IMR] & 0x3f))
+		tasklet_schedule(&emu.tasklet);
+}
+
+static void emu_reset(void)
+{
+	memset(emu.regs, 0, sizeof(emu.regs));
+	emu.regs[EMU_VIDL]     = 0x46;	/* 0x90000a46 */
+	emu.regs[EMU_VIDL + 1] = 0x0a;
+	emu.regs[EMU_VIDL + 2] = 0x00;
+	emu.regs[EMU_VIDL + 3] = 0x90;
+	emu.regs[EMU_CHIPR]    = 0x1a;
+	emu_set16(EMU_MDRAL, EMU_RX_START);
+	emu.rx_wr   = EMU_RX_START;
+	emu.tx_rd   = 0;
+	emu.tx_cnt  = 0;
+	emu.tx_slot = 0;
+}
+
+static void emu_phy_reset(void)
+{
+	memset(emu.phy, 0, sizeof(emu.phy));
+	emu.phy[0] = 0x3100;		/* 100M, auto-negotiation, full duplex */
+	emu.phy[1] = 0x7849 | (emu.link ? 0x0024 : 0);
+	emu.phy[2] = 0x0181;
+	emu.phy[3] = 0xb8c0;
+	emu.phy[4] = 0x01e1;
+	emu.phy[5] = emu.link ? 0x45e1 : 0;
+}
+
+/* 64-bit multicast hash, same CRC as the chip */
+static int emu_rx_accept(const u8 *da)
+{
+	u32 hash;
+
+	if (emu.regs[EMU_RXCR] & 0x02)			/* PRMSC */
+		return 1;
+	if (!(da[0] & 1))
+		return !memcmp(da, &emu.regs[EMU_PAR], ETH_ALEN);
+	if (emu.regs[EMU_RXCR] & 0x08)			/* ALL multicast */
+		return 1;
+	hash = ether_crc_le(ETH_ALEN, da) & 0x3f;
+	return emu.regs[EMU_MAR + hash / 8] & (1 << (hash % 8));
+}
+
+/* append one frame to the RX ring; called with emu.lock held */
+static void emu_rx_put(const u8 *data, int len, int filter)
+{
+	int total, used, i;
+	u16 p = emu.rx_wr;
+	u32 crc;
+	u8 hdr[4];
+
+	if (!(emu.regs[EMU_RXCR] & 0x01)) {
+		emu.rx_disabled++;
+		return;
+	}
+	if (filter && !emu_rx_accept(data)) {
+		emu.rx_filtered++;
+		return;
+	}
+
+	/* header + data + CRC, next frame starts on a bus word */
+	total = (4 + len + 4 + emu_width() - 1) & ~(emu_width() - 1);
+	used = (emu.rx_wr - emu_get16(EMU_MDRAL) + EMU_RX_SIZE) % EMU_RX_SIZE;
+	if (used + total >= EMU_RX_SIZE) {
+		emu.rx_overflow++;
+		emu.regs[EMU_ISR] |= 0x04;		/* ROS */
+		return;
+	}
+
+	hdr[0] = 0x01;
+	hdr[1] = (data[0] & 1) ? 0x40 : 0;		/* RSR.MF */
+	hdr[2] = (len + 4) & 0xff;
+	hdr[3] = (len + 4) >> 8;
+	crc = ~crc32_le(~0, data, len);
+
+	for (i = 0; i < total; i++) {
+		u8 c = 0;
+
+		if (i < 4)
+			c = hdr[i];
+		else if (i < 4 + len)
+			c = data[i - 4];
+		else if (i < 8 + len)
+			c = crc >> (8 * (i - 4 - len));
+		emu.sram[p] = c;
+		if (++p == EMU_RX_END)
+			p = EMU_RX_START;
+	}
+	/* ready byte of the slot behind the frame reads 00h until filled */
+	emu.sram[p] = 0;
+	emu.rx_wr = p;
+	emu.rx_frames++;
+
+	emu.regs[EMU_ISR] |= 0x01;			/* PRS */
+}
+
+/* send the outstanding TX requests; called with emu.lock held */
+static void emu_tx_run(void)
+{
+	int len, i;
+
+	while (emu.tx_cnt) {
+		len = emu.tx_len[0];
+		emu.tx_len[0] = emu.tx_len[1];
+		emu.tx_cnt--;
+
+		for (i = 0; i < len && i < EMU_TX_END; i++)
+			emu_frame[i] = emu.sram[(emu.tx_rd + i) % EMU_TX_END];
+		emu.tx_rd = (emu.tx_rd + ((len + emu_width() - 1) & ~(emu_width() - 1)))
+			    % EMU_TX_END;
+		emu.tx_frames++;
+
+		if (loopback && len >= ETH_HLEN)
+			emu_rx_put(emu_frame, len, 0);
+
+		emu.regs[emu.tx_slot ? EMU_TSR2 : EMU_TSR1] = 0;
+		emu.regs[EMU_NSR] |= emu.tx_slot ? 0x08 : 0x04;
+		emu.tx_slot ^= 1;
+		emu.regs[EMU_ISR] |= 0x02;		/* PTS */
+	}
+	emu.regs[EMU_TCR] &= ~0x01;
+}
+
+/* the "wire" and the interrupt line */
+static void emu_tasklet(unsigned long data)
+{
+	irq_handler_t handler;
+	unsigned long flags;
+	int pending;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	emu_tx_run();
+	pending = emu.regs[EMU_ISR] & emu.regs[EMU_IMR] & 0x3f;
+	handler = emu.handler;
+	spin_unlock_irqrestore(&emu.lock, flags);
+
+	if (pending && handler) {
+		emu.irqs++;
+		local_irq_save(flags);
+		handler(emu.irq, emu.dev_id);
+		local_irq_restore(flags);
+	}
+}
+
+static void emu_epcr_write(u8 value)
+{
+	int addr = emu.regs[EMU_EPAR];
+	u16 data;
+
+	emu.regs[EMU_EPCR] = value & ~0x01;		/* never busy */
+	if (!(value & 0x06))
+		return;
+
+	if (value & 0x08) {				/* EPOS : PHY */
+		addr &= 0x1f;
+		if (value & 0x04) {
+			data = emu.phy[addr];
+			if (addr == 1)			/* latched link bit */
+				emu.phy[1] = (emu.phy[1] & ~0x04) | (emu.link ? 0x04 : 0);
+		} else {
+			data = emu_get16(EMU_EPDRL);
+			if (addr == 0 && (data & 0x8000))
+				emu_phy_reset();
+			else
+				emu.phy[addr] = data;
+			return;
+		}
+	} else {					/* EEPROM */
+		addr &= 0x3f;
+		if (value & 0x04) {
+			data = emu.srom[addr];
+		} else {
+			emu.srom[addr] = emu_get16(EMU_EPDRL);
+			return;
+		}
+	}
+	emu_set16(EMU_EPDRL, data);
+}
+
+static u8 emu_reg_read(int reg)
+{
+	u8 value = emu.regs[reg];
+
+	switch (reg) {
+	case EMU_NSR:
+		value = (value & 0x2c) | (emu.link ? 0x40 : 0);
+		if (emu.link && !(emu.phy[0] & 0x2000))
+			value |= 0x80;			/* SPEED : 10M */
+		emu.regs[EMU_NSR] &= ~0x0c;		/* TXnEND clear on read */
+		break;
+	case EMU_TCR:
+		value = (value & ~0x01) | (emu.tx_cnt ? 0x01 : 0);
+		break;
+	case EMU_ISR:
+		value = (value & 0x3f) | (iomode << 6);
+		break;
+	}
+	return value;
+}
+
+static void emu_reg_write(int reg, u8 value)
+{
+	switch (reg) {
+	case EMU_NCR:
+		if (value & 0x01) {
+			emu_reset();
+			return;
+		}
+		break;
+	case EMU_NSR:
+		emu.regs[EMU_NSR] &= ~(value & 0x2c);	/* write 1 to clear */
+		return;
+	case EMU_TCR:
+		if ((value & 0x01) && emu.tx_cnt < 2) {
+			emu.tx_len[emu.tx_cnt++] = emu_get16(EMU_TXPLL);
+			tasklet_schedule(&emu.tasklet);
+		}
+		value &= ~0x01;
+		break;
+	case EMU_EPCR:
+		emu_epcr_write(value);
+		return;
+	case EMU_VIDL ... EMU_CHIPR:
+		return;					/* read only */
+	case EMU_ISR:
+		emu.regs[EMU_ISR] &= ~(value & 0x3f);
+		return;
+	case EMU_IMR:
+		emu.regs[EMU_IMR] = value;
+		emu_update_irq();
+		return;
+	}
+	emu.regs[reg] = value;
+}
+
+/* one data port read of width bytes from the RX ring */
+static u32 emu_sram_read(int width)
+{
+	u16 p = emu_get16(EMU_MDRAL);
+	u32 value = 0;
+	int i;
+
+	if (emu.index == EMU_MRCMDX)			/* prefetch, no increment */
+		return p == emu.rx_wr ? 0 : emu.sram[p];
+
+	for (i = 0; i < width; i++) {
+		value |= emu.sram[p] << (8 * i);
+		if (++p == EMU_RX_END)
+			p = EMU_RX_START;
+	}
+	emu_set16(EMU_MDRAL, p);
+	return value;
+}
+
+/* one data port write of width bytes into TX SRAM */
+static void emu_sram_write(u32 value, int width)
+{
+	u16 p = emu_get16(EMU_MDWAL);
+	int i;
+
+	for (i = 0; i < width; i++) {
+		emu.sram[p] = value >> (8 * i);
+		if (++p == EMU_TX_END)
+			p = 0;
+	}
+	emu_set16(EMU_MDWAL, p);
+}
+
+static u32 emu_data_read(int width)
+{
+	if (emu.index == EMU_MRCMDX || emu.index == EMU_MRCMD)
+		return emu_sram_read(width);
+	return emu_reg_read(emu.index);
+}
+
+static void emu_data_write(u32 value, int width)
+{
+	if (emu.index == EMU_MWCMD)
+		emu_sram_write(value, width);
+	else
+		emu_reg_write(emu.index, value);
+}
+
+/* port accessors used by the driver through dm9000c_emu.h */
+u8 dm9emu_inb(unsigned long port)
+{
+	unsigned long flags;
+	u8 value = 0xff;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	if (port == DM9EMU_BASE)
+		value = emu.index;
+	else if (port == DM9EMU_BASE + 4)
+		value = emu_data_read(1);
+	spin_unlock_irqrestore(&emu.lock, flags);
+	return value;
+}
+
+u16 dm9emu_inw(unsigned long port)
+{
+	unsigned long flags;
+	u16 value = 0xffff;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	if (port == DM9EMU_BASE + 4)
+		value = emu_data_read(2);
+	spin_unlock_irqrestore(&emu.lock, flags);
+	return value;
+}
+
+u32 dm9emu_inl(unsigned long port)
+{
+	unsigned long flags;
+	u32 value = 0xffffffff;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	if (port == DM9EMU_BASE + 4)
+		value = emu_data_read(4);
+	spin_unlock_irqrestore(&emu.lock, flags);
+	return value;
+}
+
+void dm9emu_outb(u8 value, unsigned long port)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	if (port == DM9EMU_BASE)
+		emu.index = value;
+	else if (port == DM9EMU_BASE + 4)
+		emu_data_write(value, 1);
+	spin_unlock_irqrestore(&emu.lock, flags);
+}
+
+void dm9emu_outw(u16 value, unsigned long port)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	if (port == DM9EMU_BASE + 4)
+		emu_data_write(value, 2);
+	spin_unlock_irqrestore(&emu.lock, flags);
+}
+
+void dm9emu_outl(u32 value, unsigned long port)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	if (port == DM9EMU_BASE + 4)
+		emu_data_write(value, 4);
+	spin_unlock_irqrestore(&emu.lock, flags);
+}
+
+/* string I/O : count accesses of width bytes, like readsw/writesl */
+void dm9emu_reads(unsigned long port, void *buf, int count, int width)
+{
+	unsigned long flags;
+	u8 *p = buf;
+	u32 value;
+	int i;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	while (count--) {
+		value = port == DM9EMU_BASE + 4 ? emu_data_read(width) : ~0;
+		for (i = 0; i < width; i++)
+			*p++ = value >> (8 * i);
+	}
+	spin_unlock_irqrestore(&emu.lock, flags);
+}
+
+void dm9emu_writes(unsigned long port, const void *buf, int count, int width)
+{
+	unsigned long flags;
+	const u8 *p = buf;
+	u32 value;
+	int i;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	while (count--) {
+		value = 0;
+		for (i = 0; i < width; i++)
+			value |= *p++ << (8 * i);
+		if (port == DM9EMU_BASE + 4)
+			emu_data_write(value, width);
+	}
+	spin_unlock_irqrestore(&emu.lock, flags);
+}
+
+int dm9emu_request_irq(unsigned int irq, irq_handler_t handler,
+		       unsigned long flags, const char *name, void *dev_id)
+{
+	unsigned long lflags;
+
+	spin_lock_irqsave(&emu.lock, lflags);
+	if (emu.handler) {
+		spin_unlock_irqrestore(&emu.lock, lflags);
+		return -EBUSY;
+	}
+	emu.irq = irq;
+	emu.handler = handler;
+	emu.dev_id = dev_id;
+	emu_update_irq();
+	spin_unlock_irqrestore(&emu.lock, lflags);
+	return 0;
+}
+
+void dm9emu_free_irq(unsigned int irq, void *dev_id)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	emu.handler = NULL;
+	emu.dev_id = NULL;
+	spin_unlock_irqrestore(&emu.lock, flags);
+	tasklet_kill(&emu.tasklet);
+}
+
+/* /proc/dm9emu : write one frame per write(), read counters */
+static int dm9emu_write_proc(struct file *file, const char __user *buffer,
+			     unsigned long count, void *data)
+{
+	static u8 frame[ETH_FRAME_LEN];
+	static DEFINE_MUTEX(frame_mutex);
+	unsigned long flags;
+
+	if (count < ETH_HLEN || count > ETH_FRAME_LEN)
+		return -EINVAL;
+
+	mutex_lock(&frame_mutex);
+	if (copy_from_user(frame, buffer, count)) {
+		mutex_unlock(&frame_mutex);
+		return -EFAULT;
+	}
+	spin_lock_irqsave(&emu.lock, flags);
+	emu_rx_put(frame, count, 1);
+	emu_update_irq();
+	spin_unlock_irqrestore(&emu.lock, flags);
+	mutex_unlock(&frame_mutex);
+
+	return count;
+}
+
+static int dm9emu_read_proc(char *page, char **start, off_t off,
+			    int count, int *eof, void *data)
+{
+	int len;
+
+	len = sprintf(page,
+		"tx_frames   %u\n"
+		"rx_frames   %u\n"
+		"rx_overflow %u\n"
+		"rx_filtered %u\n"
+		"rx_disabled %u\n"
+		"irqs        %u\n"
+		"link        %d\n"
+		"loopback    %d\n",
+		emu.tx_frames, emu.rx_frames, emu.rx_overflow,
+		emu.rx_filtered, emu.rx_disabled, emu.irqs,
+		emu.link, loopback);
+	*eof = 1;
+	return len;
+}
+
+/* /proc/dm9emu_link : "0" or "1", raises the link change interrupt */
+static int dm9emu_link_write_proc(struct file *file, const char __user *buffer,
+				  unsigned long count, void *data)
+{
+	unsigned long flags;
+	char c;
+
+	if (!count || get_user(c, buffer))
+		return -EFAULT;
+
+	spin_lock_irqsave(&emu.lock, flags);
+	emu.link = (c != '0');
+	emu.phy[1] = (emu.phy[1] & ~0x24) | (emu.link ? 0x24 : 0);
+	emu.phy[5] = emu.link ? 0x45e1 : 0;
+	emu.regs[EMU_ISR] |= 0x20;			/* LNKCHG */
+	emu_update_irq();
+	spin_unlock_irqrestore(&emu.lock, flags);
+
+	return count;
+}
+
+int dm9emu_init(void)
+{
+	struct proc_dir_entry *entry;
+	static const u8 mac[ETH_ALEN] = { 0x00, 0x60, 0x6e, 0x00, 0x00, 0x01 };
+	int i;
+
+	spin_lock_init(&emu.lock);
+	tasklet_init(&emu.tasklet, emu_tasklet, 0);
+	emu.link = 1;
+	emu_reset();
+	emu_phy_reset();
+
+	for (i = 0; i < 3; i++)
+		emu.srom[i] = mac[2 * i] | (mac[2 * i + 1] << 8);
+	emu.srom[4] = 0x0a46;
+	emu.srom[5] = 0x9000;
+
+	entry = create_proc_entry("dm9emu", S_IRUSR | S_IWUSR, NULL);
+	if (!entry)
+		return -ENOMEM;
+	entry->read_proc  = dm9emu_read_proc;
+	entry->write_proc = dm9emu_write_proc;
+
+	entry = create_proc_entry("dm9emu_link", S_IWUSR, NULL);
+	if (!entry) {
+		remove_proc_entry("dm9emu", NULL);
+		return -ENOMEM;
+	}
+	entry->write_proc = dm9emu_link_write_proc;
+
+	printk(KERN_INFO "dm9emu: DM9000 model at 0x%x, loopback %d\n",
+	       DM9EMU_BASE, loopback);
+	return 0;
+}
+
+void dm9emu_exit(void)
+{
+	remove_proc_entry("dm9emu_link", NULL);
+	remove_proc_entry("dm9emu", NULL);
+	tasklet_kill(&emu.tasklet);
+}
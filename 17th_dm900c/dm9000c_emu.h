@@ -0,0 +1,65 @@
+/*
+  dm9000c_emu.h: software model of the DM9000 for hardware-less runs
+
+  Built with "make EMU=1": dm9000c_drv.c is compiled with -DDM9KS_EMU and
+  linked with dm9000c_emu.c into dm9ks_emu.ko. Every port access and the
+  IRQ registration of the driver are routed to the model below, so the
+  driver code itself runs unchanged.
+*/
+#ifndef _DM9000C_EMU_H_
+#define _DM9000C_EMU_H_
+
+#include <linux/interrupt.h>
+
+#define DM9EMU_BASE		0x300	/* index port, data port is +4 */
+
+int  dm9emu_init(void);
+void dm9emu_exit(void);
+
+u8   dm9emu_inb(unsigned long port);
+u16  dm9emu_inw(unsigned long port);
+u32  dm9emu_inl(unsigned long port);
+void dm9emu_outb(u8 value, unsigned long port);
+void dm9emu_outw(u16 value, unsigned long port);
+void dm9emu_outl(u32 value, unsigned long port);
+void dm9emu_reads(unsigned long port, void *buf, int count, int width);
+void dm9emu_writes(unsigned long port, const void *buf, int count, int width);
+
+int  dm9emu_request_irq(unsigned int irq, irq_handler_t handler,
+			unsigned long flags, const char *name, void *dev_id);
+void dm9emu_free_irq(unsigned int irq, void *dev_id);
+
+#ifndef DM9EMU_IMPL
+
+#undef inb
+#undef inw
+#undef inl
+#undef outb
+#undef outw
+#undef outl
+#undef readsb
+#undef readsw
+#undef readsl
+#undef writesb
+#undef writesw
+#undef writesl
+
+#define inb(p)			dm9emu_inb((unsigned long)(p))
+#define inw(p)			dm9emu_inw((unsigned long)(p))
+#define inl(p)			dm9emu_inl((unsigned long)(p))
+#define outb(v, p)		dm9emu_outb(v, (unsigned long)(p))
+#define outw(v, p)		dm9emu_outw(v, (unsigned long)(p))
+#define outl(v, p)		dm9emu_outl(v, (unsigned long)(p))
+#define readsb(p, b, n)		dm9emu_reads((unsigned long)(p), b, n, 1)
+#define readsw(p, b, n)		dm9emu_reads((unsigned long)(p), b, n, 2)
+#define readsl(p, b, n)		dm9emu_reads((unsigned long)(p), b, n, 4)
+#define writesb(p, b, n)	dm9emu_writes((unsigned long)(p), b, n, 1)
+#define writesw(p, b, n)	dm9emu_writes((unsigned long)(p), b, n, 2)
+#define writesl(p, b, n)	dm9emu_writes((unsigned long)(p), b, n, 4)
+
+#define request_irq(i, h, f, n, d)	dm9emu_request_irq(i, h, f, n, d)
+#define free_irq(i, d)			dm9emu_free_irq(i, d)
+
+#endif /* DM9EMU_IMPL */
+
+#endif /* _DM9000C_EMU_H_ */
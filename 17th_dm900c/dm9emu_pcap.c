@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/* feed the frames of a pcap file to the DM9000 model as received traffic
+ * ./dm9emu_pcap <file.pcap> [loops] [pps]
+ *   loops : replay the file this many times, 0 = forever (default 1)
+ *   pps   : frames per second, 0 = as fast as possible (default 0)
+ */
+
+#define PCAP_MAGIC	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+#define FRAME_MAX	1514
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t  thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static int swapped;
+
+static uint32_t get32(uint32_t v)
+{
+	if (!swapped)
+		return v;
+	return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void print_usage(char *name)
+{
+	printf("Usage : \n");
+	printf("%s <file.pcap> [loops] [pps]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct pcap_file_hdr fh;
+	struct pcap_rec_hdr rh;
+	unsigned char frame[65536];
+	unsigned long sent = 0, skipped = 0;
+	int loops = 1, pps = 0, pass;
+	uint32_t len;
+	double start;
+	FILE *fp;
+	int fd;
+
+	if (argc < 2 || argc > 4)
+	{
+		print_usage(argv[0]);
+		return -1;
+	}
+	if (argc > 2)
+		loops = atoi(argv[2]);
+	if (argc > 3)
+		pps = atoi(argv[3]);
+
+	fp = fopen(argv[1], "rb");
+	if (!fp)
+	{
+		printf("can't open %s\n", argv[1]);
+		return -1;
+	}
+	if (fread(&fh, sizeof(fh), 1, fp) != 1)
+	{
+		printf("%s: short pcap header\n", argv[1]);
+		return -1;
+	}
+	/* capture written on a host of the other byte order */
+	if (fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NS)
+		swapped = 1;
+	if (get32(fh.magic) != PCAP_MAGIC && get32(fh.magic) != PCAP_MAGIC_NS)
+	{
+		printf("%s: not a pcap file\n", argv[1]);
+		return -1;
+	}
+	if (get32(fh.linktype) != LINKTYPE_ETHERNET)
+	{
+		printf("%s: link type %u is not ethernet\n", argv[1], get32(fh.linktype));
+		return -1;
+	}
+
+	fd = open("/proc/dm9emu", O_WRONLY);
+	if (fd < 0)
+	{
+		printf("can't open /proc/dm9emu, is dm9ks_emu.ko loaded?\n");
+		return -1;
+	}
+
+	start = now();
+	for (pass = 0; loops == 0 || pass < loops; pass++)
+	{
+		fseek(fp, sizeof(fh), SEEK_SET);
+		while (fread(&rh, sizeof(rh), 1, fp) == 1)
+		{
+			len = get32(rh.incl_len);
+			if (len > sizeof(frame) || fread(frame, 1, len, fp) != len)
+				break;
+			/* truncated captures and jumbo frames can't be replayed */
+			if (len < 14 || len > FRAME_MAX || len != get32(rh.orig_len))
+			{
+				skipped++;
+				continue;
+			}
+			if (write(fd, frame, len) != (ssize_t)len)
+				skipped++;
+			else
+				sent++;
+
+			if (pps)
+			{
+				double due = start + (double)sent / pps;
+
+				while (now() < due)
+					;
+			}
+		}
+	}
+
+	printf("sent %lu frames, skipped %lu, %.0f pps\n",
+	       sent, skipped, sent / (now() - start));
+	close(fd);
+	fclose(fp);
+	return 0;
+}
@@ -6,6 +6,9 @@
 #include <linux/init.h>
 #include <linux/delay.h>
 #include <linux/irq.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
 #include <asm/uaccess.h>
 #include <asm/irq.h>
 #include <asm/io.h>
@@ -16,14 +19,32 @@
 
 #define MEM_CPY_NO_DMA 0
 #define MEM_CPY_DMA    1
+#define MEM_CPY_SUBMIT 2	/* 异步提交一个拷贝请求, 参数是struct s3c_dma_desc */
+#define MEM_CPY_STRIPE 3	/* 这个文件的每个拷贝最多拆到几个通道上, 1~4, 默认1 */
+#define MEM_CPY_CPU    4	/* 同一个描述符用CPU拷, 给测试程序做对比; 缓冲区不经过cache, 比普通memcpy慢 */
+#define MEM_CPY_CHAN_STATS 5	/* 读出每个通道做完的段数, 参数是unsigned long[4], 没用上的通道是0 */
 
 #define BUF_SIZE (512*1024)
 
+/* mmap的偏移: 0开始是源缓冲区, BUF_SIZE开始是目的缓冲区 */
+#define MMAP_SRC_OFF	0
+#define MMAP_DST_OFF	BUF_SIZE
+
 #define DMA0_BASE_ADDR 0x4B000000
 #define DMA1_BASE_ADDR 0x4B000040
 #define DMA2_BASE_ADDR 0x4B000080
 #define DMA3_BASE_ADDR 0x4B0000C0
 
+/* MEM_CPY_NO_DMA/MEM_CPY_DMA每次先填缓冲区, 拷完再比较; 测速度时关掉 */
+static int verify = 1;
+module_param(verify, int, 0644);
+MODULE_PARM_DESC(verify, "fill and compare the buffers around MEM_CPY_NO_DMA/MEM_CPY_DMA (default 1)");
+
+#define DMA_MAX_COUNT	0xFFFFF	/* DCON里的TC只有20位 */
+
+#define DMA_CHANNELS	4
+#define DMA_STRIPE_MIN	(4*1024)	/* 拆开后每个通道至少做这么多, 再小不值得 */
+
 struct s3c_dma_regs{
 	unsigned long  disrc;
 	unsigned long  disrcc;
@@ -36,6 +57,55 @@ struct s3c_dma_regs{
 	unsigned long  dmasktrig;	
 };
 
+/*
+ * 异步拷贝: 应用程序用MEM_CPY_SUBMIT把请求放进提交环, 马上返回;
+ * 一个传输结束的中断里直接启动环里的下一个, 不用每次都回到应用程序.
+ * 完成记录用read()读出来, poll()可以等它.
+ * src/dst是在驱动的源/目的缓冲区里的偏移, 缓冲区可以用mmap映射到应用程序
+ */
+struct s3c_dma_desc {
+	unsigned long src;
+	unsigned long dst;
+	unsigned long len;
+	unsigned long cookie;	/* 原样放回完成记录, 给应用程序对号用 */
+};
+
+struct s3c_dma_done {
+	unsigned long cookie;
+	long status;		/* 0 : 成功 */
+};
+
+#define DMA_RING_SIZE	64	/* 2的幂 */
+
+struct s3c_dma_req {
+	struct s3c_dma_desc desc;
+	long status;
+	struct file *owner;	/* 谁提交的, 完成记录只给它 */
+	int internal;		/* MEM_CPY_DMA自己提交的, 或者记录已读/没人要了, 不用再给 */
+	int stripe;		/* 最多拆到几个通道上 */
+	int parts;		/* 启动以后还有几个通道没做完 */
+};
+
+/*
+ * 4个通道. 装载时能申请到中断的通道才用(别的驱动, 比如声卡, 可能占着),
+ * 每个通道记着自己正在做哪个请求
+ */
+struct s3c_dma_chan {
+	int claimed;
+	int irq;
+	unsigned long base;
+	volatile struct s3c_dma_regs *regs;
+	struct s3c_dma_req *req;	/* NULL : 空闲 */
+	unsigned long transfers;	/* 做完的段数, MEM_CPY_CHAN_STATS读出 */
+};
+
+static struct s3c_dma_chan dma_chans[DMA_CHANNELS] = {
+	{ .irq = IRQ_DMA0, .base = DMA0_BASE_ADDR },
+	{ .irq = IRQ_DMA1, .base = DMA1_BASE_ADDR },
+	{ .irq = IRQ_DMA2, .base = DMA2_BASE_ADDR },
+	{ .irq = IRQ_DMA3, .base = DMA3_BASE_ADDR },
+};
+
 static int major = 0;
 static  struct class *cls;
 
@@ -48,24 +118,251 @@ static u32 dst_phys;
 
 
 
-static volatile struct s3c_dma_regs *dma_regs;
 static DECLARE_WAIT_QUEUE_HEAD(dma_waitq);
-/* 中断时间标志 */
-static volatile int ev_dma = 0;
+
+/*
+ * 提交环. 四个计数器只增不减, 用的时候 & (DMA_RING_SIZE-1):
+ *   [dma_reaped, dma_done)  已完成, 等着各自的文件read()
+ *   [dma_done, dma_issue)   已经分到通道上(有的可能先做完了)
+ *   [dma_issue, dma_sub)    等着空闲通道
+ * 不同的请求可以同时在不同通道上做, 但完成记录按提交的顺序给出.
+ * 每个请求记着提交它的文件, read()只读得到自己的记录; 环头的记录被读走
+ * 或者文件关了才能回收, 一个进程不读, 别人的请求也会被挡着
+ */
+static struct s3c_dma_req dma_ring[DMA_RING_SIZE];
+static unsigned int dma_sub;
+static unsigned int dma_issue;
+static unsigned int dma_done;
+static unsigned int dma_reaped;
+static DEFINE_SPINLOCK(dma_lock);
+static DEFINE_MUTEX(dma_read_mutex);	/* 读者排队, 同一条完成记录只给一个人 */
+
+#define DMA_REQ(n)	(&dma_ring[(n) & (DMA_RING_SIZE - 1)])
+
+static int is_dma_ring_full(void)
+{
+	return dma_sub - dma_reaped >= DMA_RING_SIZE;
+}
+
+static int is_dma_idle(void)
+{
+	return dma_done == dma_sub;
+}
+
+/*
+ * 在一个通道上启动请求的一段, 调用者持有dma_lock.
+ * 传输单位按对齐自动选: 源和目的地址对4(2)同余就每次传一个字(半字),
+ * 开头没对齐的几个字节由CPU拷; 够4个单位就用burst模式(一次读写4个单位),
+ * 凑不满一次传输的尾巴也由CPU拷.
+ * 返回0表示这一段很短, CPU已经全部拷完, 没有用通道
+ */
+static int s3c_dma_start(struct s3c_dma_chan *chan, struct s3c_dma_req *req,
+			  unsigned long off, unsigned long len)
+{
+	volatile struct s3c_dma_regs *dma_regs = chan->regs;
+	unsigned long s = req->desc.src + off;
+	unsigned long d = req->desc.dst + off;
+	unsigned long head, unit, count;
+	int dsz, burst;
+
+	if (((s ^ d) & 3) == 0)
+		dsz = 2;	/* 字 */
+	else if (((s ^ d) & 1) == 0)
+		dsz = 1;	/* 半字 */
+	else
+		dsz = 0;	/* 字节 */
+
+	head = (0 - s) & ((1 << dsz) - 1);
+	if (head > len)
+		head = len;
+	memcpy(dst + d, src + s, head);
+	s   += head;
+	d   += head;
+	len -= head;
+
+	burst = (len >> dsz) >= 4;
+	unit  = (1 << dsz) << (burst ? 2 : 0);
+	count = len / unit;
+	/* 尾巴和DMA要写的地方不重叠, 先拷掉 */
+	memcpy(dst + d + count * unit, src + s + count * unit, len - count * unit);
+	if (count == 0)
+		return 0;
+
+	chan->req = req;
+
+	/*把源。目的，长度 告诉DMA*/
+	dma_regs->disrc		= src_phys + s;
+	dma_regs->disrcc	= (0<<1) | (0<<0); /*源位于AHB总线，源地址递增*/
+	dma_regs->didst		= dst_phys + d;
+	dma_regs->didstc	= (0<<2) | (0<<1) | (0<<0);/*目的位于AHB总线，目的地址递增*/
+	/*
+	 * RELOAD(bit22)=1 : TC到0后通道自己关掉. 不然会自动重装原来的
+	 * 源/目的/长度, 通道一直开着, 中断里再改寄存器启动下一个就不安全了
+	 */
+	dma_regs->dcon		= (1<<30)| (1<<29)| (burst<<28)| (1<<27) |(0<<23) |(1<<22) | (dsz<<20) | (count<<0) ;/* 使能中断，单个/burst传输，不自动重装，软件触发，每次传输dsz宽度 */
+	dma_regs->dmasktrig = (1<<1) | (1<<0) ; /*启动DMA*/
+	return 1;
+}
+
+/* 不用给记录的请求(见internal), 排到环头时直接回收, 调用者持有dma_lock */
+static void s3c_dma_reap_internal(void)
+{
+	while (dma_reaped != dma_done && DMA_REQ(dma_reaped)->internal)
+		dma_reaped++;
+}
+
+/* 这个文件最早的一条还没读的完成记录, 没有就返回NULL. 调用者持有dma_lock */
+static struct s3c_dma_req *s3c_dma_next_done(struct file *file)
+{
+	struct s3c_dma_req *req;
+	unsigned int n;
+
+	for (n = dma_reaped; n != dma_done; n++)
+	{
+		req = DMA_REQ(n);
+		if (req->owner == file && !req->internal)
+			return req;
+	}
+	return NULL;
+}
+
+static int s3c_dma_has_done(struct file *file)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&dma_lock, flags);
+	ret = s3c_dma_next_done(file) != NULL;
+	spin_unlock_irqrestore(&dma_lock, flags);
+	return ret;
+}
+
+/* 从环头开始, 所有段都做完的请求算完成, 调用者持有dma_lock */
+static void s3c_dma_advance(void)
+{
+	while (dma_done != dma_issue && DMA_REQ(dma_done)->parts == 0)
+		dma_done++;
+	s3c_dma_reap_internal();
+}
+
+/* 通道分配: 找出最多max个空闲通道, 返回找到的个数 */
+static int s3c_dma_get_chans(struct s3c_dma_chan **chans, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < DMA_CHANNELS && n < max; i++)
+	{
+		if (dma_chans[i].claimed && !dma_chans[i].req)
+			chans[n++] = &dma_chans[i];
+	}
+	return n;
+}
+
+/*
+ * 把等着的请求分到空闲通道上. 请求按条带宽度拆成几段, 每段一个通道,
+ * 空闲通道不够就少拆几段, 不等. 调用者持有dma_lock
+ */
+static void s3c_dma_kick(void)
+{
+	struct s3c_dma_chan *chans[DMA_CHANNELS];
+	struct s3c_dma_req *req;
+	unsigned long off, part, len;
+	int n, i;
+
+	while (dma_issue != dma_sub)
+	{
+		req = DMA_REQ(dma_issue);
+		n = s3c_dma_get_chans(chans, req->stripe);
+		if (n == 0)
+			break;
+		if (n > req->desc.len / DMA_STRIPE_MIN)
+			n = req->desc.len / DMA_STRIPE_MIN ? req->desc.len / DMA_STRIPE_MIN : 1;
+
+		/* 每段按16字节对齐, 最后一段拿剩下的 */
+		part = (req->desc.len / n + 15) & ~15UL;
+		req->parts = n;
+		for (i = 0, off = 0; i < n; i++, off += len)
+		{
+			len = (i == n - 1) ? req->desc.len - off : part;
+			if (!s3c_dma_start(chans[i], req, off, len))
+				req->parts--;
+		}
+		dma_issue++;
+	}
+	/* 有的请求可能全由CPU拷完了 */
+	s3c_dma_advance();
+}
+
+/*
+ * 放进提交环, 引擎空闲就马上启动. 环满了阻塞(O_NONBLOCK时返回-EAGAIN).
+ * 成功时*seq是这个请求的序号, dma_done越过它就表示完成了
+ */
+static int s3c_dma_submit(struct file *file, struct s3c_dma_desc *desc,
+			  int internal, unsigned int *seq)
+{
+	struct s3c_dma_req *req;
+	unsigned long flags;
+	unsigned int done;
+	int error;
+
+	if (desc->len == 0 || desc->len > DMA_MAX_COUNT ||
+	    desc->src > BUF_SIZE || desc->len > BUF_SIZE - desc->src ||
+	    desc->dst > BUF_SIZE || desc->len > BUF_SIZE - desc->dst)
+		return -EINVAL;
+
+	spin_lock_irqsave(&dma_lock, flags);
+	while (is_dma_ring_full())
+	{
+		spin_unlock_irqrestore(&dma_lock, flags);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		error = wait_event_interruptible(dma_waitq, !is_dma_ring_full());
+		if (error)
+			return error;
+		spin_lock_irqsave(&dma_lock, flags);
+	}
+
+	req = DMA_REQ(dma_sub);
+	req->desc     = *desc;
+	req->status   = 0;
+	req->owner    = file;
+	req->internal = internal;
+	req->stripe   = file->private_data ? (unsigned long)file->private_data : 1;
+	req->parts    = 0;
+	*seq = dma_sub++;
+	done = dma_done;
+	s3c_dma_kick();
+	spin_unlock_irqrestore(&dma_lock, flags);
+
+	/* 很短的拷贝可能已经由CPU做完了 */
+	if (done != dma_done)
+		wake_up(&dma_waitq);
+
+	return 0;
+}
 
 static int s3c_dma_ioctl (struct inode *inode, struct file *file, unsigned int cmd, unsigned long data)
 {
+	struct s3c_dma_desc desc;
+	unsigned long transfers[DMA_CHANNELS];
+	unsigned long flags;
+	unsigned int seq;
+	int error;
 	int i;
 
-	memset(src, 0xAA, BUF_SIZE);
-	memset(dst, 0x55, BUF_SIZE);
-	
 	switch (cmd)
 	{
 		case MEM_CPY_NO_DMA:
 		{
+			if (verify)
+			{
+				memset(src, 0xAA, BUF_SIZE);
+				memset(dst, 0x55, BUF_SIZE);
+			}
 			for (i=0; i<BUF_SIZE; i++)
 				dst[i] = src[i];
+			if (!verify)
+				break;
 			if(memcmp(src, dst, BUF_SIZE) == 0)
 			{
 				printk("MEM_CPY_NO_DMA OK !\n");
@@ -74,25 +371,34 @@ static int s3c_dma_ioctl (struct inode *inode, struct file *file, unsigned int c
 			{
 				printk("MEM_CPY_NO_DMA error !\n");
 			}
-			
+
 			break;
 		}
 		case MEM_CPY_DMA:
 		{
-			ev_dma = 0;
-			
-			/*把源。目的，长度 告诉DMA*/
-			dma_regs->disrc		= src_phys;
-			dma_regs->disrcc	= (0<<1) | (0<<0); /*源位于AHB总线，源地址递增*/
-			dma_regs->didst		= dst_phys;
-			dma_regs->didstc	= (0<<2) | (0<<1) | (0<<0);/*目的位于AHB总线，目的地址递增*/
-			dma_regs->dcon		= (1<<30)| (1<<29)| (0<<28)| (1<<27) |(0<<23) | (0<<20) | (BUF_SIZE<<0) ;/* 使能中断，单个传输，软件触发，每次传输一个字节 */
-			dma_regs->dmasktrig = (1<<1) | (1<<0) ; /*启动DMA*/
+			if (verify)
+			{
+				memset(src, 0xAA, BUF_SIZE);
+				memset(dst, 0x55, BUF_SIZE);
+			}
+
+			/* 和异步请求一样排队, 然后等它完成 */
+			desc.src    = 0;
+			desc.dst    = 0;
+			desc.len    = BUF_SIZE;
+			desc.cookie = 0;
+			error = s3c_dma_submit(file, &desc, 1, &seq);
+			if (error)
+				return error;
 
 			/*什么时候结束 ?*/
 			/*启动DMA后休眠*/
-			wait_event_interruptible(dma_waitq,ev_dma);
+			error = wait_event_interruptible(dma_waitq, (int)(dma_done - seq) > 0);
+			if (error)
+				return error;
 
+			if (!verify)
+				break;
 			if(memcmp(src, dst, BUF_SIZE) == 0)
 			{
 				printk("MEM_CPY_DMA OK !\n");
@@ -101,49 +407,268 @@ static int s3c_dma_ioctl (struct inode *inode, struct file *file, unsigned int c
 			{
 				printk("MEM_CPY_DMA error !\n");
 			}
-			
+
+			break;
+		}
+		case MEM_CPY_SUBMIT:
+		{
+			if (copy_from_user(&desc, (void __user *)data, sizeof(desc)))
+				return -EFAULT;
+			return s3c_dma_submit(file, &desc, 0, &seq);
+		}
+		case MEM_CPY_CPU:
+		{
+			if (copy_from_user(&desc, (void __user *)data, sizeof(desc)))
+				return -EFAULT;
+			if (desc.len > BUF_SIZE ||
+			    desc.src > BUF_SIZE - desc.len || desc.dst > BUF_SIZE - desc.len)
+				return -EINVAL;
+			memcpy(dst + desc.dst, src + desc.src, desc.len);
+			break;
+		}
+		case MEM_CPY_CHAN_STATS:
+		{
+			spin_lock_irqsave(&dma_lock, flags);
+			for (i = 0; i < DMA_CHANNELS; i++)
+				transfers[i] = dma_chans[i].transfers;
+			spin_unlock_irqrestore(&dma_lock, flags);
+			if (copy_to_user((void __user *)data, transfers, sizeof(transfers)))
+				return -EFAULT;
+			break;
+		}
+		case MEM_CPY_STRIPE:
+		{
+			if (data < 1 || data > DMA_CHANNELS)
+				return -EINVAL;
+			file->private_data = (void *)data;
+			break;
+		}
+		default:
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * 读出这个文件提交的请求的完成记录, 每条一个struct s3c_dma_done.
+ * 先拷给应用程序再标记已读, 拷贝出错时记录还留在环里; 读者之间用dma_read_mutex
+ * 排队, 被别人(比如fork出来共用这个文件的)抢先读光了就回去接着等, 不会返回0
+ */
+static ssize_t s3c_dma_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct s3c_dma_done done;
+	struct s3c_dma_req *req;
+	unsigned long flags;
+	ssize_t ret = 0;
+	int error;
+
+	if (count < sizeof(done))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&dma_read_mutex))
+		return -ERESTARTSYS;
+	while (!s3c_dma_has_done(file))
+	{
+		mutex_unlock(&dma_read_mutex);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		error = wait_event_interruptible(dma_waitq, s3c_dma_has_done(file));
+		if (error)
+			return error;
+		if (mutex_lock_interruptible(&dma_read_mutex))
+			return -ERESTARTSYS;
+	}
+
+	while (count - ret >= sizeof(done))
+	{
+		spin_lock_irqsave(&dma_lock, flags);
+		req = s3c_dma_next_done(file);
+		if (!req)
+		{
+			spin_unlock_irqrestore(&dma_lock, flags);
 			break;
 		}
+		done.cookie = req->desc.cookie;
+		done.status = req->status;
+		spin_unlock_irqrestore(&dma_lock, flags);
+
+		if (copy_to_user(buf + ret, &done, sizeof(done)))
+		{
+			if (ret == 0)
+				ret = -EFAULT;
+			break;
+		}
+		ret += sizeof(done);
+
+		/* 持有dma_read_mutex, 这条记录不会被别人读走, 也还没被回收 */
+		spin_lock_irqsave(&dma_lock, flags);
+		req->internal = 1;
+		s3c_dma_reap_internal();
+		spin_unlock_irqrestore(&dma_lock, flags);
+	}
+	mutex_unlock(&dma_read_mutex);
+
+	/* 腾出了位置, 唤醒等着提交的 */
+	if (ret > 0)
+		wake_up(&dma_waitq);
+	return ret;
+}
+
+static unsigned int s3c_dma_poll(struct file *file, poll_table *wait)
+{
+	unsigned int mask = 0;
+
+	poll_wait(file, &dma_waitq, wait);
+
+	if (s3c_dma_has_done(file))
+		mask |= POLLIN | POLLRDNORM;	/* 有完成记录可读 */
+	if (!is_dma_ring_full())
+		mask |= POLLOUT | POLLWRNORM;	/* 可以再提交 */
+
+	return mask;
+}
+
+/*
+ * 文件关了(包括进程被杀), 它还没做完和没读的请求都不再要完成记录,
+ * 当成MEM_CPY_DMA那种请求, 完成后排到环头就回收, 不会把环占满
+ */
+static int s3c_dma_release(struct inode *inode, struct file *file)
+{
+	unsigned long flags;
+	unsigned int n;
+
+	spin_lock_irqsave(&dma_lock, flags);
+	for (n = dma_reaped; n != dma_sub; n++)
+	{
+		if (DMA_REQ(n)->owner == file)
+			DMA_REQ(n)->internal = 1;
 	}
-	
+	s3c_dma_reap_internal();
+	spin_unlock_irqrestore(&dma_lock, flags);
+
+	/* 腾出了位置, 唤醒等着提交的 */
+	wake_up(&dma_waitq);
 	return 0;
 }
 
+/*
+ * 把源/目的缓冲区映射给应用程序, 数据直接在里面准备和取走, 不用再拷贝.
+ * 两个缓冲区不连续, 要分开映射, 每次只能映射其中一个的(一部分)
+ */
+static int s3c_dma_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (off < MMAP_DST_OFF)
+	{
+		if (size > MMAP_DST_OFF - off)
+			return -EINVAL;
+		return dma_mmap_writecombine(NULL, vma, src, src_phys, BUF_SIZE);
+	}
+
+	if (off - MMAP_DST_OFF >= BUF_SIZE || size > BUF_SIZE - (off - MMAP_DST_OFF))
+		return -EINVAL;
+	/* dma_mmap_writecombine把vm_pgoff当成缓冲区里的偏移 */
+	vma->vm_pgoff -= MMAP_DST_OFF >> PAGE_SHIFT;
+	return dma_mmap_writecombine(NULL, vma, dst, dst_phys, BUF_SIZE);
+}
+
 static struct file_operations dma_fops = {
 	.owner  = THIS_MODULE,
 	.ioctl  = s3c_dma_ioctl,
+	.read   = s3c_dma_read,
+	.poll   = s3c_dma_poll,
+	.mmap   = s3c_dma_mmap,
+	.release = s3c_dma_release,
 };
 
 static  irqreturn_t s3c_dma_irq(int irq, void *devid)
 {
+	struct s3c_dma_chan *chan = devid;
+	struct s3c_dma_req *req;
+	unsigned long flags;
+
+	/* 没有IRQF_DISABLED, 别的通道的中断可能打断这里 */
+	spin_lock_irqsave(&dma_lock, flags);
+	req = chan->req;
+	if (req)
+	{
+		/* 这个通道上的一段做完了, 整个请求的所有段都做完才算完成 */
+		chan->req = NULL;
+		chan->transfers++;
+		req->parts--;
+
+		/* 通道空出来了, 接着启动等着的请求 */
+		s3c_dma_kick();
+	}
+	spin_unlock_irqrestore(&dma_lock, flags);
+
 	/*唤醒*/
-	ev_dma = 1;
-	wake_up_interruptible(&dma_waitq);
+	wake_up(&dma_waitq);
 	/*唤醒应用程序，从休眠的地方往下执行 */
 	return IRQ_HANDLED;
 }
 
+static void s3c_dma_free_chans(void)
+{
+	struct s3c_dma_chan *chan;
+	int i;
+
+	for (i = 0; i < DMA_CHANNELS; i++)
+	{
+		chan = &dma_chans[i];
+		if (chan->claimed)
+			free_irq(chan->irq, chan);
+		if (chan->regs)
+			iounmap(chan->regs);
+		chan->claimed = 0;
+		chan->regs = NULL;
+	}
+}
+
 static int s3c_dma_init(void)
 {
-	if(request_irq(IRQ_DMA3,s3c_dma_irq, 0, "s3c_dma", 1))
+	struct s3c_dma_chan *chan;
+	int i, nr_chans = 0;
+
+	/* 中断里会启动下一个传输, 要先映射好寄存器 */
+	for (i = 0; i < DMA_CHANNELS; i++)
 	{
+		chan = &dma_chans[i];
+		chan->regs = ioremap(chan->base, sizeof(struct s3c_dma_regs));
+		if (!chan->regs)
+			continue;
+		if(request_irq(chan->irq, s3c_dma_irq, 0, "s3c_dma", chan))
+		{
+			printk("can't request irq for dma%d, channel not used\n", i);
+			continue;
+		}
+		chan->claimed = 1;
+		nr_chans++;
+	}
+	if (nr_chans == 0)
+	{
+		s3c_dma_free_chans();
 		printk("can't request irq for dma \n");
 		return -EBUSY;
 	}
-	
+
 	/*分配SRC,DST对应的缓冲区 ，不能用kmalloc*/
 	src = dma_alloc_writecombine(NULL, BUF_SIZE, &src_phys, GFP_KERNEL);
 	if(NULL == src) 
 	{
-		free_irq(IRQ_DMA3, 1);
+		s3c_dma_free_chans();
 		printk("can't alloc buffer for src\n");
 		return -ENOMEM;
 	}
-	
+
 	dst = dma_alloc_writecombine(NULL, BUF_SIZE, &dst_phys, GFP_KERNEL);
 	if(NULL == dst) 
 	{
-		free_irq(IRQ_DMA3, 1);
+		s3c_dma_free_chans();
 		dma_free_writecombine(NULL, BUF_SIZE, src , src_phys);
 		printk("can't alloc buffer for dst\n");
 		return -ENOMEM;
@@ -155,20 +680,22 @@ static int s3c_dma_init(void)
 	cls = class_create(THIS_MODULE,"s3c_dma");
 	class_device_create(cls, NULL, MKDEV(major,0), NULL, "dma");  /* /dev/dma */
 
-	dma_regs = ioremap(DMA3_BASE_ADDR,sizeof(struct s3c_dma_regs));
-	
 	return 0;
 }
 
 static void s3c_dma_exit(void)
 {
-	iounmap(dma_regs);
 	class_device_destroy(cls, MKDEV(major, 0));
 	class_destroy(cls);
 	unregister_chrdev(major, "s3c_dma");
+	/*
+	 * 关闭设备时可能还有异步请求没做完, 等它们结束再释放缓冲区.
+	 * 这里是不可中断的睡眠, 所以各处都用wake_up而不是wake_up_interruptible
+	 */
+	wait_event(dma_waitq, is_dma_idle());
+	s3c_dma_free_chans();
 	dma_free_writecombine(NULL, BUF_SIZE, src, src_phys);
-	dma_free_writecombine(NULL, BUF_SIZE, dst, dst_phys);	
-	free_irq(IRQ_DMA3, 1);
+	dma_free_writecombine(NULL, BUF_SIZE, dst, dst_phys);
 }
 
 module_init(s3c_dma_init);
@@ -1,28 +1,350 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 
 #define MEM_CPY_NO_DMA 0
 #define MEM_CPY_DMA    1
+#define MEM_CPY_SUBMIT 2
+#define MEM_CPY_STRIPE 3
+#define MEM_CPY_CPU    4
+#define MEM_CPY_CHAN_STATS 5
+
+#define DMA_CHANNELS	4
+
+#define BUF_SIZE (512*1024)
+
+#define MMAP_SRC_OFF	0
+#define MMAP_DST_OFF	BUF_SIZE
+
+struct s3c_dma_desc {
+	unsigned long src;
+	unsigned long dst;
+	unsigned long len;
+	unsigned long cookie;
+};
+
+struct s3c_dma_done {
+	unsigned long cookie;
+	long status;
+};
 
 /* ./dma_test nodma  
  * ./dma_test dma 
+ * ./dma_test async : 把缓冲区切成64K一块, 一直异步提交, 用poll等完成
+ * ./dma_test stripe : 整个缓冲区拆到1~4个通道上拷贝, 比较速度, 列出每个通道做了几段
+ * ./dma_test mmap   : 映射源/目的缓冲区, 自己填数据, DMA拷贝后直接检查
+ * ./dma_test bench [verify] : 1K~512K各种大小, CPU(普通内存/DMA缓冲区)/DMA单通道/DMA 4通道对比,
+ *                    给出每次调用延迟的分位数, MB/s和拷贝期间CPU占用
  */
 void print_usage(char *name)
 {
 	printf("Usage : \n");
-	printf("%s <nodma | dma>  <count> \n",name);
+	printf("%s <nodma | dma | async | stripe | mmap | bench [verify]>  <count> \n",name);
+}
+
+#define STRIPE_LOOPS 64
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#define BENCH_MIN_LOOPS	16
+#define BENCH_MAX_LOOPS	1000
+#define BENCH_BYTES	(16*1024*1024)	/* 每种大小大概拷这么多 */
+
+/*
+ * BENCH_CPU_CACHED : 普通(可缓存)内存之间memcpy, 这才是不用DMA时的真实速度
+ * BENCH_CPU        : 驱动里在writecombine缓冲区之间memcpy, 读不经过cache, 很慢
+ */
+enum { BENCH_CPU_CACHED, BENCH_CPU, BENCH_DMA, BENCH_STRIPE };
+static const char *bench_name[] = { "cpu", "cpu (uncached)", "dma x1", "dma x4" };
+static unsigned char *cached_src, *cached_dst;
+
+/* /proc/stat第一行: 总时间和空闲时间(idle+iowait) */
+static int cpu_times(unsigned long long *total, unsigned long long *idle)
+{
+	unsigned long long v[7];
+	FILE *fp;
+	int i, n;
+
+	fp = fopen("/proc/stat", "r");
+	if (!fp)
+		return -1;
+	n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]);
+	fclose(fp);
+	if (n < 4)
+		return -1;
+	*total = 0;
+	for (i = 0; i < n; i++)
+		*total += v[i];
+	*idle = v[3] + (n > 4 ? v[4] : 0);
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* 一次拷贝, 同步完成 */
+static int bench_one(int fd, int method, struct s3c_dma_desc *desc)
+{
+	struct s3c_dma_done done;
+
+	if (method == BENCH_CPU_CACHED)
+	{
+		memcpy(cached_dst + desc->dst, cached_src + desc->src, desc->len);
+		return 0;
+	}
+	if (method == BENCH_CPU)
+		return ioctl(fd, MEM_CPY_CPU, desc);
+	if (ioctl(fd, MEM_CPY_SUBMIT, desc) < 0 ||
+	    read(fd, &done, sizeof(done)) != sizeof(done) ||
+	    done.cookie != desc->cookie || done.status)
+		return -1;
+	return 0;
+}
+
+static int bench(int fd, int verify)
+{
+	static double lat[BENCH_MAX_LOOPS];
+	unsigned long long t0, i0, t1, i1;
+	struct s3c_dma_desc desc;
+	unsigned char *src = NULL, *dst = NULL;
+	unsigned char *vsrc, *vdst;
+	unsigned long size;
+	int method, loops, i;
+	double start, elapsed, busy;
+
+	cached_src = malloc(BUF_SIZE);
+	cached_dst = malloc(BUF_SIZE);
+	if (!cached_src || !cached_dst)
+	{
+		printf("can't malloc %d bytes\n", BUF_SIZE);
+		return -1;
+	}
+	memset(cached_src, 0, BUF_SIZE);
+	memset(cached_dst, 0, BUF_SIZE);
+
+	if (verify)
+	{
+		src = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, MMAP_SRC_OFF);
+		dst = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, MMAP_DST_OFF);
+		if (src == MAP_FAILED || dst == MAP_FAILED)
+		{
+			printf("can't mmap /dev/dma\n");
+			return -1;
+		}
+	}
+
+	printf("%8s %-14s %6s %9s %9s %9s %9s %6s\n",
+	       "size", "method", "loops", "p50(us)", "p90(us)", "p99(us)", "MB/s", "cpu%");
+	for (size = 1024; size <= BUF_SIZE; size *= 2)
+	{
+		loops = BENCH_BYTES / size;
+		if (loops < BENCH_MIN_LOOPS)
+			loops = BENCH_MIN_LOOPS;
+		if (loops > BENCH_MAX_LOOPS)
+			loops = BENCH_MAX_LOOPS;
+
+		for (method = BENCH_CPU_CACHED; method <= BENCH_STRIPE; method++)
+		{
+			ioctl(fd, MEM_CPY_STRIPE, method == BENCH_STRIPE ? 4 : 1);
+			desc.src = 0;
+			desc.dst = 0;
+			desc.len = size;
+
+			/* cpu那一行用的是自己malloc的缓冲区 */
+			vsrc = method == BENCH_CPU_CACHED ? cached_src : src;
+			vdst = method == BENCH_CPU_CACHED ? cached_dst : dst;
+			if (verify)
+			{
+				for (i = 0; i < (int)size; i++)
+					vsrc[i] = i + size + method;
+				memset(vdst, 0, size);
+			}
+
+			if (cpu_times(&t0, &i0) < 0)
+				t0 = i0 = 0;
+			start = now();
+			for (i = 0; i < loops; i++)
+			{
+				double t = now();
+
+				desc.cookie = i;
+				if (bench_one(fd, method, &desc) < 0)
+				{
+					printf("%s copy of %lu bytes failed\n", bench_name[method], size);
+					return -1;
+				}
+				lat[i] = (now() - t) * 1e6;
+			}
+			elapsed = now() - start;
+			if (cpu_times(&t1, &i1) < 0 || t1 == t0)
+				busy = -1;
+			else
+				busy = 100.0 * (1.0 - (double)(i1 - i0) / (t1 - t0));
+
+			qsort(lat, loops, sizeof(lat[0]), cmp_double);
+			printf("%8lu %-14s %6d %9.1f %9.1f %9.1f %9.2f %6.1f%s\n",
+			       size, bench_name[method], loops,
+			       lat[loops / 2], lat[loops * 9 / 10], lat[loops * 99 / 100],
+			       (double)size * loops / elapsed / (1024 * 1024), busy,
+			       verify && memcmp(vsrc, vdst, size) ? "  MISMATCH" : "");
+		}
+	}
+	return 0;
+}
+
+static int mmap_copy(int fd)
+{
+	struct s3c_dma_desc desc;
+	struct s3c_dma_done done;
+	unsigned char *src, *dst;
+	unsigned long loops = 0;
+	int i;
+
+	src = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, MMAP_SRC_OFF);
+	dst = mmap(NULL, BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, MMAP_DST_OFF);
+	if (src == MAP_FAILED || dst == MAP_FAILED)
+	{
+		printf("can't mmap /dev/dma\n");
+		return -1;
+	}
+
+	while (1)
+	{
+		for (i = 0; i < BUF_SIZE; i++)
+			src[i] = i + loops;
+		/* 故意不对齐, 头尾要由驱动用CPU拷 */
+		desc.src    = 1;
+		desc.dst    = 1;
+		desc.len    = BUF_SIZE - 3;
+		desc.cookie = loops;
+		if (ioctl(fd, MEM_CPY_SUBMIT, &desc) < 0 ||
+		    read(fd, &done, sizeof(done)) != sizeof(done) ||
+		    done.cookie != desc.cookie || done.status)
+		{
+			printf("copy failed\n");
+			return -1;
+		}
+		if (memcmp(src + 1, dst + 1, BUF_SIZE - 3) != 0)
+			printf("loop %lu : data mismatch\n", loops);
+		else if (++loops % 100 == 0)
+			printf("%lu copies verified\n", loops);
+	}
+	return 0;
+}
+
+static int stripe_copy(int fd)
+{
+	struct s3c_dma_desc desc;
+	struct s3c_dma_done done;
+	unsigned long before[DMA_CHANNELS], after[DMA_CHANNELS];
+	double start, mbs, single = 0;
+	int chans, i;
+
+	desc.src = 0;
+	desc.dst = 0;
+	desc.len = BUF_SIZE;
+	for (chans = 1; chans <= 4; chans++)
+	{
+		if (ioctl(fd, MEM_CPY_STRIPE, chans) < 0 ||
+		    ioctl(fd, MEM_CPY_CHAN_STATS, before) < 0)
+			return -1;
+		start = now();
+		for (i = 0; i < STRIPE_LOOPS; i++)
+		{
+			desc.cookie = i;
+			if (ioctl(fd, MEM_CPY_SUBMIT, &desc) < 0 ||
+			    read(fd, &done, sizeof(done)) != sizeof(done) ||
+			    done.cookie != desc.cookie || done.status)
+			{
+				printf("copy failed on %d channels\n", chans);
+				return -1;
+			}
+		}
+		mbs = (double)STRIPE_LOOPS * BUF_SIZE / (now() - start) / (1024 * 1024);
+		if (chans == 1)
+			single = mbs;
+		printf("%d channel(s) : %8.2f MB/s  x%.2f\n", chans, mbs, mbs / single);
+
+		/* 没申请到中断的通道一直是0 */
+		if (ioctl(fd, MEM_CPY_CHAN_STATS, after) < 0)
+			return -1;
+		printf("    transfers :");
+		for (i = 0; i < DMA_CHANNELS; i++)
+			printf(" dma%d %lu", i, after[i] - before[i]);
+		printf("\n");
+	}
+	return 0;
+}
+
+#define ASYNC_CHUNK (64*1024)
+
+static int async_copy(int fd)
+{
+	struct s3c_dma_desc desc;
+	struct s3c_dma_done done[16];
+	struct pollfd pfd;
+	unsigned long next = 0, completed = 0;
+	int n, i;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN | POLLOUT;
+	while (1)
+	{
+		if (poll(&pfd, 1, -1) < 0)
+			return -1;
+
+		/* 环里有位置就一直提交 */
+		while (pfd.revents & POLLOUT)
+		{
+			desc.src    = (next % (BUF_SIZE / ASYNC_CHUNK)) * ASYNC_CHUNK;
+			desc.dst    = desc.src;
+			desc.len    = ASYNC_CHUNK;
+			desc.cookie = next;
+			if (ioctl(fd, MEM_CPY_SUBMIT, &desc) < 0)
+				break;
+			next++;
+		}
+
+		if (pfd.revents & POLLIN)
+		{
+			n = read(fd, done, sizeof(done));
+			for (i = 0; i < n / (int)sizeof(done[0]); i++)
+			{
+				if (done[i].status)
+					printf("copy %lu failed : %ld\n", done[i].cookie, done[i].status);
+				if (++completed % 1024 == 0)
+					printf("%lu copies done\n", completed);
+			}
+		}
+	}
+	return 0;
 }
 int main(int argc, char ** argv)
 {
 	int fd;
 	
-	if(argc !=2 )
+	if(argc < 2 || argc > 3)
 	{
 		print_usage(argv[0]);
 		return -1;
@@ -48,6 +370,23 @@ int main(int argc, char ** argv)
 			ioctl(fd,MEM_CPY_DMA);
 		}
 	}
+	else if(strcmp(argv[1],"bench")==0)
+	{
+		return bench(fd, argc > 2 && strcmp(argv[2],"verify")==0);
+	}
+	else if(strcmp(argv[1],"mmap")==0)
+	{
+		return mmap_copy(fd);
+	}
+	else if(strcmp(argv[1],"stripe")==0)
+	{
+		return stripe_copy(fd);
+	}
+	else if(strcmp(argv[1],"async")==0)
+	{
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		return async_copy(fd);
+	}
 	else
 	{
 		print_usage(argv[0]);